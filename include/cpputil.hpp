@@ -9,10 +9,32 @@
 #include <cmath>
 #include <fstream>
 #include <sstream>
+#include <cstring>
 #include <chrono>
+#include <random>
 #include <exception>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <omp.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <x86intrin.h>
 #include <json.hpp>
 
@@ -20,9 +42,17 @@ using namespace std;
 using namespace nlohmann;
 
 namespace cpputil {
+    template<typename Iterable, typename = void>
+    struct has_reserve : false_type {};
+
+    template<typename Iterable>
+    struct has_reserve<Iterable, void_t<decltype(
+            declval<Iterable &>().reserve(size_t()))>> : true_type {};
+
     template<typename UnaryOperation, typename Iterable>
     Iterable fmap(UnaryOperation op, const Iterable &v) {
         Iterable result;
+        if constexpr (has_reserve<Iterable>::value) result.reserve(v.size());
         std::transform(v.begin(), v.end(), std::back_inserter(result), op);
         return result;
     }
@@ -34,6 +64,154 @@ namespace cpputil {
         return result;
     }
 
+    // execution policy tag for OpenMP-backed overloads
+    struct Parallel {};
+    constexpr Parallel par{};
+
+    // Iterable must be random access and default constructible with size
+    template<typename UnaryOperation, typename Iterable>
+    Iterable fmap(Parallel, UnaryOperation op, const Iterable &v) {
+        const auto n = static_cast<long>(v.size());
+        Iterable result(n);
+#pragma omp parallel for
+        for (long i = 0; i < n; ++i) {
+            result[i] = op(v[i]);
+        }
+        return result;
+    }
+
+    template<typename Predicate, typename Iterable>
+    Iterable filter(Parallel, Predicate pred, const Iterable &v) {
+        const auto n = static_cast<long>(v.size());
+        vector<char> flags(n);
+        vector<size_t> offsets(omp_get_max_threads() + 1, 0);
+
+        Iterable result;
+#pragma omp parallel
+        {
+            // split into contiguous chunks so that output keeps input order
+            const int n_threads = omp_get_num_threads();
+            const int thread_id = omp_get_thread_num();
+            const long begin = n * thread_id / n_threads;
+            const long end = n * (thread_id + 1) / n_threads;
+
+            // 1st pass: count
+            size_t count = 0;
+            for (long i = begin; i < end; ++i) {
+                flags[i] = pred(v[i]);
+                count += flags[i];
+            }
+            offsets[thread_id + 1] = count;
+
+#pragma omp barrier
+#pragma omp single
+            {
+                // prefix sum
+                for (int t = 0; t < n_threads; ++t) {
+                    offsets[t + 1] += offsets[t];
+                }
+                result = Iterable(offsets[n_threads]);
+            }
+
+            // 2nd pass: scatter
+            auto pos = offsets[thread_id];
+            for (long i = begin; i < end; ++i) {
+                if (flags[i]) result[pos++] = v[i];
+            }
+        }
+        return result;
+    }
+
+    // lazy views: fmap_view / filter_view compose without intermediate
+    // containers and are evaluated in one pass by collect()
+    template<typename UnaryOperation, typename Range>
+    struct FmapView {
+        UnaryOperation op;
+        Range range;
+
+        using BaseIterator = decltype(declval<const remove_reference_t<Range> &>().begin());
+
+        struct iterator {
+            BaseIterator it;
+            const UnaryOperation *op;
+
+            decltype(auto) operator*() const { return (*op)(*it); }
+
+            auto &operator++() {
+                ++it;
+                return *this;
+            }
+
+            bool operator==(const iterator &o) const { return it == o.it; }
+
+            bool operator!=(const iterator &o) const { return it != o.it; }
+        };
+
+        FmapView(UnaryOperation op, Range &&range) :
+                op(op), range(std::forward<Range>(range)) {}
+
+        auto begin() const { return iterator{range.begin(), &op}; }
+
+        auto end() const { return iterator{range.end(), &op}; }
+    };
+
+    template<typename Predicate, typename Range>
+    struct FilterView {
+        Predicate pred;
+        Range range;
+
+        using BaseIterator = decltype(declval<const remove_reference_t<Range> &>().begin());
+
+        struct iterator {
+            BaseIterator it, last;
+            const Predicate *pred;
+
+            iterator(BaseIterator it, BaseIterator last, const Predicate *pred) :
+                    it(it), last(last), pred(pred) { skip(); }
+
+            void skip() {
+                while (it != last && !(*pred)(*it)) ++it;
+            }
+
+            decltype(auto) operator*() const { return *it; }
+
+            auto &operator++() {
+                ++it;
+                skip();
+                return *this;
+            }
+
+            bool operator==(const iterator &o) const { return it == o.it; }
+
+            bool operator!=(const iterator &o) const { return it != o.it; }
+        };
+
+        FilterView(Predicate pred, Range &&range) :
+                pred(pred), range(std::forward<Range>(range)) {}
+
+        auto begin() const { return iterator(range.begin(), range.end(), &pred); }
+
+        auto end() const { return iterator(range.end(), range.end(), &pred); }
+    };
+
+    // lvalue ranges are referenced, rvalue ranges (e.g. views) are moved in
+    template<typename UnaryOperation, typename Range>
+    auto fmap_view(UnaryOperation op, Range &&range) {
+        return FmapView<UnaryOperation, Range>(op, std::forward<Range>(range));
+    }
+
+    template<typename Predicate, typename Range>
+    auto filter_view(Predicate pred, Range &&range) {
+        return FilterView<Predicate, Range>(pred, std::forward<Range>(range));
+    }
+
+    template<typename View>
+    auto collect(const View &view) {
+        vector<decay_t<decltype(*view.begin())>> result;
+        for (auto &&e : view) result.push_back(e);
+        return result;
+    }
+
     template<typename T = float>
     struct Data {
         size_t id;
@@ -118,7 +296,7 @@ namespace cpputil {
     auto l2_norm(const Data<T> &p) {
         float result = 0;
         for (size_t i = 0; i < p.size(); i++) {
-            result += std::pow(p[i], 2);
+            result += p[i] * p[i];
         }
         result = std::sqrt(result);
         return result;
@@ -207,6 +385,111 @@ namespace cpputil {
         return dist;
     }
 
+    float ip_avx(const float *x, const float *y, size_t d) {
+
+        __m256 msum1 = _mm256_setzero_ps();
+
+        while (d >= 8) {
+            __m256 mx = _mm256_loadu_ps(x);
+            x += 8;
+            __m256 my = _mm256_loadu_ps(y);
+            y += 8;
+            msum1 += mx * my;
+            d -= 8;
+        }
+
+        __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
+        msum2 += _mm256_extractf128_ps(msum1, 0);
+
+        if (d >= 4) {
+            __m128 mx = _mm_loadu_ps(x);
+            x += 4;
+            __m128 my = _mm_loadu_ps(y);
+            y += 4;
+            msum2 += mx * my;
+            d -= 4;
+        }
+
+        if (d > 0) {
+            __m128 mx = masked_read(d, x);
+            __m128 my = masked_read(d, y);
+            msum2 += mx * my;
+        }
+
+        msum2 = _mm_hadd_ps(msum2, msum2);
+        msum2 = _mm_hadd_ps(msum2, msum2);
+        return _mm_cvtss_f32(msum2);
+    }
+
+    static inline float hsum_avx(__m256 v) {
+        __m128 msum = _mm256_extractf128_ps(v, 1) + _mm256_extractf128_ps(v, 0);
+        msum = _mm_hadd_ps(msum, msum);
+        msum = _mm_hadd_ps(msum, msum);
+        return _mm_cvtss_f32(msum);
+    }
+
+    // inner products of one query token against 4 doc tokens, loading the
+    // query once per 8 floats
+    void ip_block4_avx(const float *q, const float *d0, const float *d1,
+                       const float *d2, const float *d3, size_t dim, float *out) {
+        __m256 m0 = _mm256_setzero_ps(), m1 = _mm256_setzero_ps();
+        __m256 m2 = _mm256_setzero_ps(), m3 = _mm256_setzero_ps();
+
+        size_t i = 0;
+        for (; i + 8 <= dim; i += 8) {
+            const __m256 mq = _mm256_loadu_ps(q + i);
+            m0 += mq * _mm256_loadu_ps(d0 + i);
+            m1 += mq * _mm256_loadu_ps(d1 + i);
+            m2 += mq * _mm256_loadu_ps(d2 + i);
+            m3 += mq * _mm256_loadu_ps(d3 + i);
+        }
+
+        out[0] = hsum_avx(m0);
+        out[1] = hsum_avx(m1);
+        out[2] = hsum_avx(m2);
+        out[3] = hsum_avx(m3);
+        for (; i < dim; ++i) {
+            out[0] += q[i] * d0[i];
+            out[1] += q[i] * d1[i];
+            out[2] += q[i] * d2[i];
+            out[3] += q[i] * d3[i];
+        }
+    }
+
+    // squared l2 distances of one query against 4 rows at once, so that
+    // loads of independent rows overlap
+    void l2_sqr_block4_avx(const float *q, const float *d0, const float *d1,
+                           const float *d2, const float *d3, size_t dim, float *out) {
+        __m256 m0 = _mm256_setzero_ps(), m1 = _mm256_setzero_ps();
+        __m256 m2 = _mm256_setzero_ps(), m3 = _mm256_setzero_ps();
+
+        size_t i = 0;
+        for (; i + 8 <= dim; i += 8) {
+            const __m256 mq = _mm256_loadu_ps(q + i);
+            const __m256 a0 = mq - _mm256_loadu_ps(d0 + i);
+            const __m256 a1 = mq - _mm256_loadu_ps(d1 + i);
+            const __m256 a2 = mq - _mm256_loadu_ps(d2 + i);
+            const __m256 a3 = mq - _mm256_loadu_ps(d3 + i);
+            m0 += a0 * a0;
+            m1 += a1 * a1;
+            m2 += a2 * a2;
+            m3 += a3 * a3;
+        }
+
+        out[0] = hsum_avx(m0);
+        out[1] = hsum_avx(m1);
+        out[2] = hsum_avx(m2);
+        out[3] = hsum_avx(m3);
+        for (; i < dim; ++i) {
+            const float a0 = q[i] - d0[i], a1 = q[i] - d1[i];
+            const float a2 = q[i] - d2[i], a3 = q[i] - d3[i];
+            out[0] += a0 * a0;
+            out[1] += a1 * a1;
+            out[2] += a2 * a2;
+            out[3] += a3 * a3;
+        }
+    }
+
 #endif
 
     template<typename T = float>
@@ -315,6 +598,7 @@ namespace cpputil {
     constexpr auto double_min = numeric_limits<double>::min();
 
     constexpr auto float_max = numeric_limits<float>::max();
+    constexpr auto int_max = numeric_limits<int>::max();
     constexpr auto float_min = numeric_limits<float>::min();
 
     struct Neighbor {
@@ -345,27 +629,76 @@ namespace cpputil {
         }
     };
 
-    template<typename T>
-    auto scan_knn_search(const Data<T> &query, int k, const Dataset<T> &dataset) {
-        auto threshold = float_max;
+    // keep the k nearest candidates in a max heap ordered by dist
+    void push_candidate(Neighbors &heap, int k, float dist, int id) {
+        if (heap.size() < k) {
+            heap.emplace_back(dist, id);
+            push_heap(heap.begin(), heap.end(), CompLess());
+            return;
+        }
 
-        multimap<float, int> result_map;
-        for (const auto &data : dataset) {
-            const auto dist = euclidean_distance(query, data);
+        if (dist >= heap.front().dist) return;
+        pop_heap(heap.begin(), heap.end(), CompLess());
+        heap.back() = Neighbor(dist, id);
+        push_heap(heap.begin(), heap.end(), CompLess());
+    }
+
+    // set of visited ids which is cleared in O(1) by advancing the epoch
+    struct VisitedSet {
+        vector<unsigned int> marks;
+        unsigned int epoch = 0;
 
-            if (result_map.size() < k || dist < threshold) {
-                result_map.emplace(dist, data.id);
-                threshold = (--result_map.cend())->first;
-                if (result_map.size() > k) result_map.erase(--result_map.cend());
+        void reset(int n) {
+            if (marks.size() < n) marks.resize(n, 0);
+            if (++epoch == 0) {
+                fill(marks.begin(), marks.end(), 0);
+                epoch = 1;
             }
         }
 
-        vector<Neighbor> result;
-        for (const auto &result_pair : result_map) {
-            result.emplace_back(result_pair.first, result_pair.second);
+        bool contains(int id) const { return marks[id] == epoch; }
+
+        // returns false if id was already visited
+        bool insert(int id) {
+            if (marks[id] == epoch) return false;
+            marks[id] = epoch;
+            return true;
+        }
+    };
+
+    // scratch space reused by search routines. buffers only grow, so after
+    // warming up a query does not touch the allocator
+    struct SearchBuffer {
+        Neighbors candidates;
+        Neighbors pool;
+        VisitedSet visited;
+        vector<float> scores;       // per-item scores, e.g. of maxsim_search
+        int prefetch_distance = 8;  // rows fetched ahead of the scan
+
+        void reset(int k) {
+            candidates.clear();
+            candidates.reserve(k);
+            pool.clear();
         }
+    };
 
-        return result;
+    SearchBuffer &get_search_buffer() {
+        thread_local SearchBuffer buffer;
+        return buffer;
+    }
+
+    template<typename T>
+    auto scan_knn_search(const Data<T> &query, int k, const Dataset<T> &dataset) {
+        auto &heap = get_search_buffer().candidates;
+        heap.clear();
+
+        for (const auto &data : dataset) {
+            const auto dist = euclidean_distance(query, data);
+            push_candidate(heap, k, dist, data.id);
+        }
+
+        sort_heap(heap.begin(), heap.end(), CompLess());
+        return vector<Neighbor>(heap.begin(), heap.end());
     }
 
     template<typename T = float>
@@ -453,41 +786,237 @@ namespace cpputil {
         return neighbors_list;
     }
 
+    // cpus the calling process may run on. unlike hardware_concurrency this
+    // respects sched_setaffinity, e.g. pin_to_numa_node
+    int count_cpus() {
+        cpu_set_t cpus;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) return CPU_COUNT(&cpus);
+        return max(1u, thread::hardware_concurrency());
+    }
+
+    void pread_all(int fd, char *buf, size_t size, size_t offset) {
+        while (size > 0) {
+            const auto received = pread(fd, buf, size, offset);
+            if (received <= 0)
+                throw runtime_error("can't read file");
+            buf += received;
+            offset += received;
+            size -= received;
+        }
+    }
+
+    // read rows [begin, begin + n) of a binary file into out as float.
+    // rows start at data_offset, each with a head_size-byte prefix holding
+    // the dimension (.vecs formats) followed by dim values of type T.
+    // chunks of rows are read with pread by several threads and converted in
+    // place. plain threads are used so that forked shard workers can load
+    template<typename T>
+    void pread_rows(const string &path, size_t data_offset, int head_size,
+                    int begin, int n, int dim, float *out,
+                    int n_threads = count_cpus(),
+                    size_t chunk_bytes = 1 << 22) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("can't open file: " + path);
+
+        struct stat st{};
+        fstat(fd, &st);
+        const size_t row_size = head_size + dim * sizeof(T);
+        if (data_offset + (static_cast<size_t>(begin) + n) * row_size > st.st_size) {
+            close(fd);
+            throw runtime_error("rows out of range: " + path);
+        }
+
+        const int chunk_rows = max<size_t>(1, chunk_bytes / row_size);
+        const int n_chunks = (n + chunk_rows - 1) / chunk_rows;
+        n_threads = max(1, min(n_threads, n_chunks));
+        vector<exception_ptr> errors(n_threads);
+
+        const auto read_chunks = [&](int thread_id) {
+            vector<char> buf(chunk_rows * row_size);
+            for (int chunk = thread_id; chunk < n_chunks; chunk += n_threads) {
+                const int head = chunk * chunk_rows;
+                const int n_rows = min(chunk_rows, n - head);
+                pread_all(fd, buf.data(), n_rows * row_size,
+                          data_offset + (static_cast<size_t>(begin) + head) * row_size);
+
+                for (int r = 0; r < n_rows; ++r) {
+                    const char *row = &buf[r * row_size];
+                    if (head_size > 0) {
+                        int row_dim;
+                        memcpy(&row_dim, row, sizeof(int));
+                        if (row_dim != dim)
+                            throw runtime_error("dimension not matched");
+                    }
+
+                    float *dst = out + static_cast<size_t>(head + r) * dim;
+                    if constexpr (is_same_v<T, float>) {
+                        memcpy(dst, row + head_size, dim * sizeof(float));
+                    } else {
+                        for (int j = 0; j < dim; ++j) {
+                            T val;
+                            memcpy(&val, row + head_size + j * sizeof(T), sizeof(T));
+                            dst[j] = val;
+                        }
+                    }
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (int thread_id = 0; thread_id < n_threads; ++thread_id) {
+            threads.emplace_back([&, thread_id]() {
+                try { read_chunks(thread_id); }
+                catch (...) { errors[thread_id] = current_exception(); }
+            });
+        }
+        for (auto &t : threads) t.join();
+        close(fd);
+
+        for (const auto &error : errors) {
+            if (error) rethrow_exception(error);
+        }
+    }
+
+    // header of a .npy file (version 1-3, C order, 2-d)
+    struct NpyHeader {
+        string descr;
+        size_t n, dim, data_offset;
+
+        NpyHeader(const string &path) {
+            ifstream ifs(path, ios::binary);
+            if (!ifs)
+                throw runtime_error("can't open file: " + path);
+
+            char preamble[8];
+            ifs.read(preamble, 8);
+            if (!ifs || string(preamble, 6) != "\x93NUMPY")
+                throw runtime_error("invalid npy file: " + path);
+
+            size_t header_len = 0;
+            const int major = preamble[6];
+            ifs.read((char *) &header_len, major == 1 ? 2 : 4);
+            data_offset = 8 + (major == 1 ? 2 : 4) + header_len;
+
+            string header(header_len, ' ');
+            ifs.read(&header[0], header_len);
+
+            const auto descr_pos = header.find('\'', header.find("'descr'") + 7);
+            descr = header.substr(descr_pos + 1,
+                                  header.find('\'', descr_pos + 1) - descr_pos - 1);
+
+            if (header.find("'fortran_order': False") == string::npos)
+                throw runtime_error("fortran order npy is not supported");
+
+            const auto shape_begin = header.find('(', header.find("'shape'"));
+            const auto shape_end = header.find(')', shape_begin);
+            auto shape_str = header.substr(shape_begin + 1, shape_end - shape_begin - 1);
+            auto shape = split<double>(shape_str);
+            if (shape.size() == 1) shape.emplace_back(1);
+            if (shape.size() != 2)
+                throw runtime_error("only 2-d npy is supported");
+            n = shape[0];
+            dim = shape[1];
+        }
+    };
+
+    constexpr size_t huge_page_size = 1 << 21;
+
+    // ask for transparent huge pages on the huge page aligned part of
+    // [p, p + size). only pages faulted in afterwards are affected
+    void advise_huge_pages(void *p, size_t size) {
+        const auto first = (reinterpret_cast<uintptr_t>(p) + huge_page_size - 1)
+                           / huge_page_size * huge_page_size;
+        const auto last = (reinterpret_cast<uintptr_t>(p) + size)
+                          / huge_page_size * huge_page_size;
+        if (first < last)
+            madvise(reinterpret_cast<void *>(first), last - first, MADV_HUGEPAGE);
+    }
+
+    // bring every cache line of a row towards L1
+    void prefetch_row(const float *row, int dim) {
+        const auto p = reinterpret_cast<const char *>(row);
+        for (size_t offset = 0; offset < dim * sizeof(float); offset += 64) {
+            _mm_prefetch(p + offset, _MM_HINT_T0);
+        }
+    }
+
     struct DataArray {
         vector<float> x;
         int n, dim;
+        bool normalized = false;  // every row has unit l2 norm
 
         using Data = vector<float>::const_iterator;
 
-        DataArray(int n, int dim) : n(n), dim(dim), x(n * dim) {}
+        // with huge_pages, x is reserved untouched, advised for transparent
+        // huge pages and only then zero filled, to cut TLB misses of scans
+        DataArray(int n, int dim, bool huge_pages = false) : n(n), dim(dim) {
+            if (huge_pages) {
+                x.reserve(static_cast<size_t>(n) * dim);
+                advise_huge_pages(x.data(), x.capacity() * sizeof(float));
+            }
+            x.resize(static_cast<size_t>(n) * dim);
+        }
+
+        auto load(const vector<float> &v) {
+            x = v;
+            normalized = false;
+        }
+
+        auto load_fvecs(const string &path, int begin = 0) {
+            pread_rows<float>(path, 0, 4, begin, n, dim, x.data());
+        }
 
-        auto load(const vector<float> &v) { x = v; }
+        auto load_bvecs(const string &path, int begin = 0) {
+            pread_rows<uint8_t>(path, 0, 4, begin, n, dim, x.data());
+        }
 
-        auto load_fvecs(const string &path) {
-            float *row = new float[dim];
+        // .fbin / .u8bin / .ibin: int32 n, int32 dim, then row major payload
+        template<typename T>
+        auto load_bin(const string &path, int begin = 0) {
             ifstream ifs(path, ios::binary);
             if (!ifs)
                 throw runtime_error("can't open file: " + path);
 
-            for (int i = 0; i < n; i++) {
-                int head = 0;
-                ifs.read((char *) &head, 4);
+            int header[2];
+            ifs.read((char *) header, sizeof(header));
+            if (header[1] != dim)
+                throw runtime_error("dimension not matched");
+            if (begin + n > header[0])
+                throw runtime_error("rows out of range: " + path);
 
-                if (head != dim)
-                    throw runtime_error("dimension not matched");
+            pread_rows<T>(path, sizeof(header), 0, begin, n, dim, x.data());
+        }
 
-                ifs.read((char *) row, head * sizeof(float));
-                for (int j = 0; j < dim; j++) {
-                    x[i * dim + j] = row[j];
-                }
-            }
+        auto load_npy(const string &path, int begin = 0) {
+            const auto header = NpyHeader(path);
+            if (header.dim != dim)
+                throw runtime_error("dimension not matched");
+            if (begin + n > header.n)
+                throw runtime_error("rows out of range: " + path);
+
+            const auto offset = header.data_offset;
+            const auto &descr = header.descr;
+            if (descr == "<f4")
+                pread_rows<float>(path, offset, 0, begin, n, dim, x.data());
+            else if (descr == "<f8")
+                pread_rows<double>(path, offset, 0, begin, n, dim, x.data());
+            else if (descr == "|u1")
+                pread_rows<uint8_t>(path, offset, 0, begin, n, dim, x.data());
+            else if (descr == "|i1")
+                pread_rows<int8_t>(path, offset, 0, begin, n, dim, x.data());
+            else if (descr == "<i4")
+                pread_rows<int32_t>(path, offset, 0, begin, n, dim, x.data());
+            else
+                throw runtime_error("unsupported npy dtype: " + descr);
         }
 
-        auto load_csv(const string &path) {
+        auto load_csv(const string &path, int begin = 0) {
             ifstream ifs(path);
             if (!ifs) throw runtime_error("Can't open file!");
 
             string line;
+            for (int i = 0; i < begin && getline(ifs, line); ++i);
             for (int i = 0; i < n && getline(ifs, line); ++i) {
                 auto v = split(line);
                 for (int j = 0; j < dim; j++) {
@@ -496,19 +1025,48 @@ namespace cpputil {
             }
         }
 
-        auto load(const string &path) {
+        auto save_fvecs(const string &path) const {
+            ofstream ofs(path, ios::binary);
+            if (!ofs)
+                throw runtime_error("can't open file: " + path);
+
+            for (int i = 0; i < n; i++) {
+                ofs.write((const char *) &dim, 4);
+                ofs.write((const char *) &x[static_cast<size_t>(i) * dim], dim * sizeof(float));
+            }
+        }
+
+        // load rows [begin, begin + n)
+        auto load(const string &path, int begin = 0) {
+            normalized = false;
             if (ends_with(".fvecs", path))
-                load_fvecs(path);
+                load_fvecs(path, begin);
+            else if (ends_with(".bvecs", path))
+                load_bvecs(path, begin);
+            else if (ends_with(".fbin", path))
+                load_bin<float>(path, begin);
+            else if (ends_with(".u8bin", path))
+                load_bin<uint8_t>(path, begin);
+            else if (ends_with(".ibin", path))
+                load_bin<int32_t>(path, begin);
+            else if (ends_with(".npy", path))
+                load_npy(path, begin);
             else if (ends_with(".csv", path))
-                load_csv(path);
+                load_csv(path, begin);
             else
                 throw runtime_error("invalid file type");
         }
 
         decltype(auto) operator[](int i) { return x[i]; }
 
+        decltype(auto) operator[](int i) const { return x[i]; }
+
         decltype(auto) find(int i) {
-            return next(x.begin(), i * dim);
+            return next(x.begin(), static_cast<size_t>(i) * dim);
+        }
+
+        decltype(auto) find(int i) const {
+            return next(x.cbegin(), static_cast<size_t>(i) * dim);
         }
     };
 
@@ -527,7 +1085,24 @@ namespace cpputil {
         return result;
     }
 
+    auto l2_sqr(DataArray::Data data_1, DataArray::Data data_2, int dim) {
+#ifdef __AVX__
+        return l2_sqr_avx(&(*data_1), &(*data_2), dim);
+#endif
+
+        float result = 0;
+        for (int i = 0; i < dim; ++i, ++data_1, ++data_2) {
+            const auto diff = *data_1 - *data_2;
+            result += diff * diff;
+        }
+        return result;
+    }
+
     auto inner_product(DataArray::Data data_1, DataArray::Data data_2, int dim) {
+#ifdef __AVX__
+        return ip_avx(&(*data_1), &(*data_2), dim);
+#endif
+
         float result = 0;
         for (int i = 0; i < dim; ++i) {
             result += *data_1 * *data_2;
@@ -537,42 +1112,108 @@ namespace cpputil {
         return result;
     }
 
-    auto knn_scan(int k, DataArray::Data query, DataArray dataset,
-                  string dist_kind = "l2") {
-        auto candidates = map<float, int>();
+    // scale every row to unit length, so that cosine similarity is a plain
+    // inner product. call once after loading
+    void normalize(DataArray &dataset) {
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < dataset.n; ++i) {
+            const auto data = dataset.find(i);
+            const auto norm = sqrt(inner_product(data, data, dataset.dim));
+            if (norm == 0) continue;
+            for (int j = 0; j < dataset.dim; ++j) data[j] /= norm;
+        }
+        dataset.normalized = true;
+    }
 
-        for (int data_id = 0; data_id < dataset.n; ++data_id) {
-            const auto data = dataset.find(data_id);
+    enum class DistKind { l2, ip, cosine, angular };
 
-            float dist_val;
-            if (dist_kind == "l2") {
-                dist_val = l2_dist(query, data, dataset.dim);
-            } else if (dist_kind == "ip") {
-                dist_val = -inner_product(query, data, dataset.dim);
-            }
+    auto get_dist_kind(const string &dist_kind) {
+        if (dist_kind == "l2") return DistKind::l2;
+        if (dist_kind == "ip") return DistKind::ip;
+        if (dist_kind == "cosine") return DistKind::cosine;
+        if (dist_kind == "angular") return DistKind::angular;
+        throw runtime_error("invalid dist kind: " + dist_kind);
+    }
 
-            if (candidates.size() < k) {
-                candidates.emplace(dist_val, data_id);
-                continue;
-            }
+    // result is overwritten and keeps its capacity, so it can be reused
+    // across queries.
+    // "ip" and "cosine" report similarities in descending order, "angular"
+    // reports acos(cosine) / pi like angular_distance. with a normalized
+    // dataset a cosine comparison is a single inner product
+    void knn_scan(int k, DataArray::Data query, const DataArray &dataset,
+                  Neighbors &result, const string &dist_kind = "l2",
+                  SearchBuffer &buffer = get_search_buffer()) {
+        const auto kind = get_dist_kind(dist_kind);
+        const int dim = dataset.dim;
+        const bool is_cosine = (kind == DistKind::cosine || kind == DistKind::angular);
+        const float query_norm = is_cosine ? sqrt(inner_product(query, query, dim)) : 1;
+
+        buffer.reset(k);
+        auto &heap = buffer.candidates;
+        const bool is_ip = (kind == DistKind::ip || (is_cosine && dataset.normalized));
+        const int distance = buffer.prefetch_distance;
+
+        // l2 candidates are compared by squared distance
+        int data_id = 0;
+#ifdef __AVX__
+        if (kind == DistKind::l2 || is_ip) {
+            const float *q = &(*query);
+            float dists[4];
+            for (; data_id + 4 <= dataset.n; data_id += 4) {
+                const auto ahead = min(data_id + distance, dataset.n - 4);
+                for (int r = 0; r < 4 && distance > 0; ++r) {
+                    prefetch_row(&dataset.x[static_cast<size_t>(ahead + r) * dim], dim);
+                }
 
-            const auto furthest = --candidates.cend();
-            if (dist_val < furthest->first) {
-                candidates.emplace(dist_val, data_id);
-                candidates.erase(furthest);
+                const float *d = &dataset.x[static_cast<size_t>(data_id) * dim];
+                if (is_ip) {
+                    ip_block4_avx(q, d, d + dim, d + 2 * dim, d + 3 * dim, dim, dists);
+                    for (auto &dist : dists) dist = -dist;
+                } else {
+                    l2_sqr_block4_avx(q, d, d + dim, d + 2 * dim, d + 3 * dim, dim, dists);
+                }
+                for (int r = 0; r < 4; ++r) {
+                    push_candidate(heap, k, dists[r], data_id + r);
+                }
             }
         }
+#endif
 
-        Neighbors result;
-        for (const auto candidate : candidates) {
-            float dist_val = candidate.first;
-            if (dist_kind == "ip")
-                dist_val = -dist_val;
+        for (; data_id < dataset.n; ++data_id) {
+            const auto data = dataset.find(data_id);
 
-            auto data_id = candidate.second;
-            result.emplace_back(dist_val, data_id);
+            float dist_val;
+            if (kind == DistKind::l2) {
+                dist_val = l2_sqr(query, data, dim);
+            } else if (is_ip) {
+                dist_val = -inner_product(query, data, dim);
+            } else {
+                const auto norm = sqrt(inner_product(data, data, dim));
+                dist_val = (norm == 0) ? 0 : -inner_product(query, data, dim) / norm;
+            }
+            push_candidate(heap, k, dist_val, data_id);
+        }
+
+        sort_heap(heap.begin(), heap.end(), CompLess());
+        result.assign(heap.begin(), heap.end());
+
+        // only the top-k are converted back
+        for (auto &neighbor : result) {
+            if (kind == DistKind::l2) {
+                neighbor.dist = sqrt(neighbor.dist);
+            } else if (kind == DistKind::ip) {
+                neighbor.dist = -neighbor.dist;
+            } else if (is_cosine) {
+                neighbor.dist = clip(-neighbor.dist / query_norm, -1.0f, 1.0f);
+                if (kind == DistKind::angular) neighbor.dist = acos(neighbor.dist) / pi;
+            }
         }
+    }
 
+    auto knn_scan(int k, DataArray::Data query, const DataArray &dataset,
+                  string dist_kind = "l2") {
+        Neighbors result;
+        knn_scan(k, query, dataset, result, dist_kind);
         return result;
     }
 
@@ -599,11 +1240,35 @@ namespace cpputil {
             }
         }
 
+        // int32 n, int32 k, then n x k ids (distances may follow)
+        auto load_ibin(const string &path) {
+            ifstream ifs(path, ios::binary);
+            if (!ifs)
+                throw runtime_error("can't open file: " + path);
+
+            int header[2];
+            if (!ifs.read((char *) header, sizeof(header)))
+                throw runtime_error("invalid ibin file: " + path);
+            if (header[0] < n)
+                throw runtime_error("rows out of range: " + path);
+            if (header[1] < k)
+                throw runtime_error("k not matched");
+
+            vector<int> row(header[1]);
+            for (int i = 0; i < n; i++) {
+                if (!ifs.read((char *) row.data(), row.size() * sizeof(int)))
+                    throw runtime_error("truncated file: " + path);
+                x[i].assign(row.begin(), next(row.begin(), k));
+            }
+        }
+
         decltype(auto) operator[](int i) { return x[i]; }
 
         auto load(const string &path) {
             if (ends_with(".ivecs", path))
                 load_ivecs(path);
+            else if (ends_with(".ibin", path))
+                load_ibin(path);
             else
                 throw runtime_error("invalid file type");
         }
@@ -628,6 +1293,1762 @@ namespace cpputil {
         recall /= actual.size();
         return recall;
     }
+
+    struct SearchReport {
+        float recall;
+        long time;  // microseconds
+        float qps;
+    };
+
+    // run search(query_id) -> Neighbors for every query and check it
+    // against the ground truth
+    template<typename Search>
+    auto evaluate_search(int k, int n_queries, const GroundTruth &gt,
+                         Search search) {
+        vector<Neighbors> results(n_queries);
+
+        const auto start = get_now();
+        for (int query_id = 0; query_id < n_queries; ++query_id) {
+            results[query_id] = search(query_id);
+        }
+        const auto end = get_now();
+
+        float recall = 0;
+        for (int query_id = 0; query_id < n_queries; ++query_id) {
+            recall += calc_recall(results[query_id], gt.x[query_id], k);
+        }
+
+        SearchReport report{};
+        report.recall = recall / n_queries;
+        report.time = get_duration(start, end);
+        report.qps = n_queries / (max(report.time, 1L) / 1e6f);
+        return report;
+    }
+
+    auto calc_mean(const DataArray &dataset) {
+        vector<double> sum(dataset.dim, 0);
+        for (int i = 0; i < dataset.n; ++i) {
+            const auto data = dataset.find(i);
+            for (int j = 0; j < dataset.dim; ++j) sum[j] += data[j];
+        }
+
+        vector<float> mean(dataset.dim);
+        for (int j = 0; j < dataset.dim; ++j) mean[j] = sum[j] / dataset.n;
+        return mean;
+    }
+
+    // covariance matrix (dim x dim, row major) computed as a blocked SYRK:
+    // each block of rows is centered and transposed so that every entry is
+    // a contiguous dot product, and each thread accumulates its own matrix
+    auto calc_covariance(const DataArray &dataset, const vector<float> &mean,
+                         int block_size = 64) {
+        const int dim = dataset.dim;
+        vector<double> cov(dim * dim, 0);
+
+#pragma omp parallel
+        {
+            vector<double> local_cov(dim * dim, 0);
+            vector<float> block(dim * block_size);
+
+#pragma omp for schedule(dynamic)
+            for (int head = 0; head < dataset.n; head += block_size) {
+                const int n_rows = min(block_size, dataset.n - head);
+
+                for (int r = 0; r < n_rows; ++r) {
+                    const auto data = dataset.find(head + r);
+                    for (int j = 0; j < dim; ++j) {
+                        block[j * block_size + r] = data[j] - mean[j];
+                    }
+                }
+
+                for (int a = 0; a < dim; ++a) {
+                    const float *col_a = &block[a * block_size];
+                    for (int b = a; b < dim; ++b) {
+                        const float *col_b = &block[b * block_size];
+                        float dot = 0;
+                        for (int r = 0; r < n_rows; ++r) dot += col_a[r] * col_b[r];
+                        local_cov[a * dim + b] += dot;
+                    }
+                }
+            }
+
+#pragma omp critical
+            for (int i = 0; i < dim * dim; ++i) cov[i] += local_cov[i];
+        }
+
+        vector<float> result(dim * dim);
+        for (int a = 0; a < dim; ++a) {
+            for (int b = a; b < dim; ++b) {
+                result[a * dim + b] = result[b * dim + a] = cov[a * dim + b] / dataset.n;
+            }
+        }
+        return result;
+    }
+
+    // modified Gram-Schmidt over the rows of a (n_rows x dim) matrix
+    void orthonormalize(vector<float> &m, int n_rows, int dim) {
+        for (int i = 0; i < n_rows; ++i) {
+            const auto row_i = m.begin() + i * dim;
+            for (int j = 0; j < i; ++j) {
+                const auto row_j = m.begin() + j * dim;
+                const auto dot = std::inner_product(row_i, row_i + dim, row_j, 0.0);
+                for (int d = 0; d < dim; ++d) row_i[d] -= dot * row_j[d];
+            }
+            const auto norm = sqrt(std::inner_product(row_i, row_i + dim, row_i, 0.0));
+            if (norm == 0)
+                throw runtime_error("rank deficient matrix");
+            for (int d = 0; d < dim; ++d) row_i[d] /= norm;
+        }
+    }
+
+    // linear map y = W (x - mean), W is (out_dim x dim) with orthonormal rows
+    struct Projection {
+        int dim, out_dim;
+        vector<float> mean;
+        vector<float> components;
+        vector<float> variances;  // explained variance per component (PCA)
+
+        Projection(int dim, int out_dim) :
+                dim(dim), out_dim(out_dim), mean(dim, 0),
+                components(out_dim * dim), variances(out_dim, 0) {}
+
+        DataArray::Data find(int i) const {
+            return next(components.cbegin(), i * dim);
+        }
+
+        auto transform(const DataArray &dataset) const {
+            if (dataset.dim != dim)
+                throw runtime_error("dimension not matched");
+
+            vector<float> offsets(out_dim);
+            for (int j = 0; j < out_dim; ++j) {
+                offsets[j] = inner_product(find(j), mean.cbegin(), dim);
+            }
+
+            auto result = DataArray(dataset.n, out_dim);
+#pragma omp parallel for schedule(static)
+            for (int i = 0; i < dataset.n; ++i) {
+                const auto data = dataset.find(i);
+                for (int j = 0; j < out_dim; ++j) {
+                    result[i * out_dim + j] =
+                            inner_product(find(j), data, dim) - offsets[j];
+                }
+            }
+            return result;
+        }
+    };
+
+    // top out_dim principal components by orthogonal (subspace) iteration
+    auto fit_pca(const DataArray &dataset, int out_dim, int n_iter = 100,
+                 unsigned int seed = 0) {
+        const int dim = dataset.dim;
+        if (out_dim > dim)
+            throw runtime_error("out_dim must not exceed dim");
+
+        auto projection = Projection(dim, out_dim);
+        projection.mean = calc_mean(dataset);
+        const auto cov = calc_covariance(dataset, projection.mean);
+
+        mt19937 engine(seed);
+        normal_distribution<float> normal;
+        auto &q = projection.components;
+        for (auto &e : q) e = normal(engine);
+        orthonormalize(q, out_dim, dim);
+
+        vector<float> z(out_dim * dim);
+        const auto multiply = [&]() {
+#pragma omp parallel for collapse(2)
+            for (int i = 0; i < out_dim; ++i) {
+                for (int a = 0; a < dim; ++a) {
+                    z[i * dim + a] = inner_product(
+                            next(cov.cbegin(), a * dim), projection.find(i), dim);
+                }
+            }
+        };
+
+        for (int iter = 0; iter < n_iter; ++iter) {
+            multiply();
+            q = z;
+            orthonormalize(q, out_dim, dim);
+        }
+
+        // Rayleigh quotients, then order components by variance
+        multiply();
+        vector<pair<float, int>> order(out_dim);
+        for (int i = 0; i < out_dim; ++i) {
+            order[i] = {inner_product(projection.find(i), next(z.cbegin(), i * dim), dim), i};
+        }
+        sort(order.begin(), order.end(), greater<>());
+
+        const auto unsorted = q;
+        for (int i = 0; i < out_dim; ++i) {
+            projection.variances[i] = order[i].first;
+            copy_n(next(unsorted.cbegin(), order[i].second * dim), dim,
+                   next(q.begin(), i * dim));
+        }
+        return projection;
+    }
+
+    // data independent random orthogonal projection
+    auto random_projection(int dim, int out_dim, unsigned int seed = 0) {
+        if (out_dim > dim)
+            throw runtime_error("out_dim must not exceed dim");
+
+        auto projection = Projection(dim, out_dim);
+
+        mt19937 engine(seed);
+        normal_distribution<float> normal;
+        for (auto &e : projection.components) e = normal(engine);
+        orthonormalize(projection.components, out_dim, dim);
+        return projection;
+    }
+
+    // scan the reduced dataset for n_candidates and rerank them with the
+    // full dimensional vectors
+    auto knn_scan_rerank(int k, int n_candidates,
+                         DataArray::Data query, const DataArray &dataset,
+                         DataArray::Data reduced_query,
+                         const DataArray &reduced_dataset) {
+        auto candidates = knn_scan(n_candidates, reduced_query, reduced_dataset);
+
+        for (auto &candidate : candidates) {
+            candidate.dist = l2_dist(query, dataset.find(candidate.id), dataset.dim);
+        }
+        sort_neighbors(candidates);
+        if (candidates.size() > k) candidates.resize(k);
+        return candidates;
+    }
+
+    struct ReductionReport {
+        int out_dim, n_candidates;
+        SearchReport report;
+        float speedup;  // qps over the full dimensional knn_scan
+    };
+
+    // full knn_scan against fit_pca to each out_dim plus knn_scan_rerank of
+    // each n_candidates. the projection is fitted outside of the timing
+    auto benchmark_reduction(int k, const DataArray &dataset, const DataArray &queries,
+                             const GroundTruth &gt, const vector<int> &out_dims,
+                             const vector<int> &n_candidates_list) {
+        const auto full = evaluate_search(k, queries.n, gt, [&](int query_id) {
+            return knn_scan(k, queries.find(query_id), dataset);
+        });
+
+        vector<ReductionReport> reports;
+        for (const auto out_dim : out_dims) {
+            const auto pca = fit_pca(dataset, out_dim);
+            const auto reduced_dataset = pca.transform(dataset);
+            const auto reduced_queries = pca.transform(queries);
+
+            for (const auto n_candidates : n_candidates_list) {
+                ReductionReport report{out_dim, n_candidates};
+                report.report = evaluate_search(k, queries.n, gt, [&](int query_id) {
+                    return knn_scan_rerank(k, n_candidates, queries.find(query_id), dataset,
+                                           reduced_queries.find(query_id), reduced_dataset);
+                });
+                report.speedup = report.report.qps / full.qps;
+                reports.emplace_back(report);
+            }
+        }
+        return reports;
+    }
+
+    // hardware event counter for the calling thread via perf_event_open
+    struct PerfCounter {
+        int fd;
+
+        PerfCounter(unsigned int type = PERF_TYPE_HARDWARE,
+                    unsigned long long config = PERF_COUNT_HW_CACHE_MISSES) {
+            perf_event_attr attr{};
+            attr.type = type;
+            attr.size = sizeof(attr);
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd == -1)
+                throw runtime_error("can't open perf event");
+        }
+
+        PerfCounter(const PerfCounter &) = delete;
+
+        PerfCounter &operator=(const PerfCounter &) = delete;
+
+        ~PerfCounter() { close(fd); }
+
+        void start() {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+
+        auto stop() {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            long long count = 0;
+            if (read(fd, &count, sizeof(count)) != sizeof(count))
+                throw runtime_error("can't read perf event");
+            return count;
+        }
+    };
+
+    // Lloyd's algorithm, initialized with randomly sampled rows.
+    // returns centroids and the cluster id of each row
+    auto kmeans(const DataArray &dataset, int n_clusters, int n_iter = 10,
+                unsigned int seed = 0) {
+        const int dim = dataset.dim;
+        if (n_clusters > dataset.n)
+            throw runtime_error("n_clusters must not exceed n");
+
+        vector<int> ids(dataset.n);
+        iota(ids.begin(), ids.end(), 0);
+        shuffle(ids.begin(), ids.end(), mt19937(seed));
+
+        auto centroids = DataArray(n_clusters, dim);
+        for (int c = 0; c < n_clusters; ++c) {
+            copy_n(dataset.find(ids[c]), dim, centroids.find(c));
+        }
+
+        vector<int> assignment(dataset.n);
+        for (int iter = 0; iter <= n_iter; ++iter) {
+#pragma omp parallel for schedule(static)
+            for (int i = 0; i < dataset.n; ++i) {
+                auto nearest = Neighbor();
+                for (int c = 0; c < n_clusters; ++c) {
+                    const auto dist = l2_dist(dataset.find(i), centroids.find(c), dim);
+                    if (dist < nearest.dist) nearest = Neighbor(dist, c);
+                }
+                assignment[i] = nearest.id;
+            }
+            if (iter == n_iter) break;
+
+            vector<double> sums(n_clusters * dim, 0);
+            vector<int> counts(n_clusters, 0);
+            for (int i = 0; i < dataset.n; ++i) {
+                const auto data = dataset.find(i);
+                const auto c = assignment[i];
+                for (int j = 0; j < dim; ++j) sums[c * dim + j] += data[j];
+                ++counts[c];
+            }
+
+            for (int c = 0; c < n_clusters; ++c) {
+                // keep the previous centroid of an empty cluster
+                if (counts[c] == 0) continue;
+                for (int j = 0; j < dim; ++j) {
+                    centroids[c * dim + j] = sums[c * dim + j] / counts[c];
+                }
+            }
+        }
+
+        return make_pair(centroids, assignment);
+    }
+
+    // a permutation is given as order[new_id] = old_id
+
+    // rows grouped by k-means cluster, nearest to the centroid first
+    auto cluster_order(const DataArray &dataset, int n_clusters,
+                       int n_iter = 10, unsigned int seed = 0) {
+        const auto[centroids, assignment] = kmeans(dataset, n_clusters, n_iter, seed);
+
+        vector<float> dists(dataset.n);
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < dataset.n; ++i) {
+            dists[i] = l2_dist(dataset.find(i), centroids.find(assignment[i]),
+                               dataset.dim);
+        }
+
+        vector<int> order(dataset.n);
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](int i, int j) {
+            if (assignment[i] != assignment[j]) return assignment[i] < assignment[j];
+            return dists[i] < dists[j];
+        });
+        return order;
+    }
+
+    // position of (x, y) on the Hilbert curve filling a side x side grid
+    auto hilbert_index(unsigned int side, unsigned int x, unsigned int y) {
+        unsigned long long d = 0;
+        for (unsigned int s = side / 2; s > 0; s /= 2) {
+            const unsigned int rx = (x & s) > 0;
+            const unsigned int ry = (y & s) > 0;
+            d += static_cast<unsigned long long>(s) * s * ((3 * rx) ^ ry);
+            // rotate
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = side - 1 - x;
+                    y = side - 1 - y;
+                }
+                swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    // rows sorted along a Hilbert curve over the top 2 principal components
+    auto hilbert_order(const DataArray &dataset, int bits = 16,
+                       unsigned int seed = 0) {
+        const auto projection = fit_pca(dataset, 2, 20, seed);
+        const auto coords = projection.transform(dataset);
+
+        float min_val[2] = {float_max, float_max};
+        float max_val[2] = {-float_max, -float_max};
+        for (int i = 0; i < dataset.n; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                min_val[j] = min(min_val[j], coords[i * 2 + j]);
+                max_val[j] = max(max_val[j], coords[i * 2 + j]);
+            }
+        }
+
+        const unsigned int side = 1u << bits;
+        vector<unsigned long long> keys(dataset.n);
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < dataset.n; ++i) {
+            unsigned int q[2];
+            for (int j = 0; j < 2; ++j) {
+                const auto range = max(max_val[j] - min_val[j], float_min);
+                const auto v = (coords[i * 2 + j] - min_val[j]) / range;
+                q[j] = min(static_cast<unsigned int>(v * side), side - 1);
+            }
+            keys[i] = hilbert_index(side, q[0], q[1]);
+        }
+
+        vector<int> order(dataset.n);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(),
+                    [&](int i, int j) { return keys[i] < keys[j]; });
+        return order;
+    }
+
+    // breadth first traversal of a neighbor graph, so that rows visited
+    // together are stored together. unreachable nodes follow in id order
+    auto graph_order(const vector<Neighbors> &graph, int start = 0) {
+        const int n = graph.size();
+        vector<char> visited(n, false);
+        vector<int> order;
+        order.reserve(n);
+
+        for (int i = 0; i < n; ++i) {
+            const int root = (i == 0) ? start : i;
+            if (visited[root]) continue;
+
+            queue<int> q;
+            q.push(root);
+            visited[root] = true;
+            while (!q.empty()) {
+                const auto id = q.front();
+                q.pop();
+                order.emplace_back(id);
+                for (const auto &neighbor : graph[id]) {
+                    if (visited[neighbor.id]) continue;
+                    visited[neighbor.id] = true;
+                    q.push(neighbor.id);
+                }
+            }
+        }
+        return order;
+    }
+
+    auto inverse_order(const vector<int> &order) {
+        vector<int> inverse(order.size());
+        for (int new_id = 0; new_id < order.size(); ++new_id) {
+            inverse[order[new_id]] = new_id;
+        }
+        return inverse;
+    }
+
+    auto reorder(const DataArray &dataset, const vector<int> &order) {
+        if (order.size() != dataset.n)
+            throw runtime_error("order size not matched");
+
+        auto result = DataArray(dataset.n, dataset.dim);
+        result.normalized = dataset.normalized;
+#pragma omp parallel for schedule(static)
+        for (int new_id = 0; new_id < dataset.n; ++new_id) {
+            copy_n(dataset.find(order[new_id]), dataset.dim, result.find(new_id));
+        }
+        return result;
+    }
+
+    // renumber both the nodes and the edges of a neighbor graph
+    auto reorder(const vector<Neighbors> &graph, const vector<int> &order) {
+        const auto inverse = inverse_order(order);
+
+        vector<Neighbors> result(graph.size());
+        for (int new_id = 0; new_id < graph.size(); ++new_id) {
+            result[new_id] = graph[order[new_id]];
+            for (auto &neighbor : result[new_id]) {
+                neighbor.id = inverse[neighbor.id];
+            }
+        }
+        return result;
+    }
+
+    // map ids of a reordered dataset back to the original ids
+    void restore_ids(Neighbors &neighbors, const vector<int> &order) {
+        for (auto &neighbor : neighbors) neighbor.id = order[neighbor.id];
+    }
+
+    // k-way merge of sorted neighbor lists
+    auto merge_neighbors(const vector<Neighbors> &lists, int k) {
+        using Head = pair<Neighbor, int>;  // (neighbor, list id)
+        const auto comp = [](const Head &h1, const Head &h2) {
+            return h1.first.dist > h2.first.dist;
+        };
+        priority_queue<Head, vector<Head>, decltype(comp)> heads(comp);
+        vector<size_t> positions(lists.size(), 0);
+
+        for (int list_id = 0; list_id < lists.size(); ++list_id) {
+            if (lists[list_id].empty()) continue;
+            heads.emplace(lists[list_id][0], list_id);
+        }
+
+        Neighbors result;
+        while (result.size() < k && !heads.empty()) {
+            const auto[neighbor, list_id] = heads.top();
+            heads.pop();
+            if (neighbor.id >= 0) result.emplace_back(neighbor);
+
+            const auto &list = lists[list_id];
+            if (++positions[list_id] < list.size())
+                heads.emplace(list[positions[list_id]], list_id);
+        }
+        return result;
+    }
+
+    // split rows of an fvecs file into n_shards contiguous files
+    // (path_prefix.<shard_id>.fvecs). returns the first id of each shard
+    auto partition_fvecs(const string &path, int n, int dim, int n_shards,
+                         const string &path_prefix) {
+        ifstream ifs(path, ios::binary);
+        if (!ifs)
+            throw runtime_error("can't open file: " + path);
+
+        vector<char> row(4 + dim * sizeof(float));
+        ifs.seekg(0, ios::end);
+        if (static_cast<size_t>(ifs.tellg()) < static_cast<size_t>(n) * row.size())
+            throw runtime_error("rows out of range: " + path);
+        ifs.seekg(0);
+
+        vector<int> offsets(n_shards + 1);
+        for (int shard_id = 0; shard_id <= n_shards; ++shard_id) {
+            offsets[shard_id] = static_cast<long>(n) * shard_id / n_shards;
+        }
+
+        for (int shard_id = 0; shard_id < n_shards; ++shard_id) {
+            const auto shard_path = path_prefix + '.' + to_string(shard_id) + ".fvecs";
+            ofstream ofs(shard_path, ios::binary);
+            if (!ofs)
+                throw runtime_error("can't open file: " + shard_path);
+
+            for (int i = offsets[shard_id]; i < offsets[shard_id + 1]; ++i) {
+                ifs.read(row.data(), row.size());
+                if (!ifs || *reinterpret_cast<int *>(row.data()) != dim)
+                    throw runtime_error("dimension not matched");
+                ofs.write(row.data(), row.size());
+            }
+        }
+        return offsets;
+    }
+
+    auto count_numa_nodes() {
+        int n_nodes = 0;
+        while (ifstream("/sys/devices/system/node/node" + to_string(n_nodes) + "/cpulist"))
+            ++n_nodes;
+        return n_nodes;
+    }
+
+    // restrict the calling process to the cpus of a NUMA node.
+    // returns false if the topology is not available
+    auto pin_to_numa_node(int node) {
+        ifstream ifs("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        string cpulist;
+        if (!ifs || !getline(ifs, cpulist)) return false;
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        istringstream stream(cpulist);
+        string range;
+        while (getline(stream, range, ',')) {
+            const auto hyphen = range.find('-');
+            const int first = stoi(range.substr(0, hyphen));
+            const int last = (hyphen == string::npos) ? first : stoi(range.substr(hyphen + 1));
+            for (int cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, &cpus);
+        }
+        return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+    }
+
+    void write_all(int fd, const void *buf, size_t size) {
+        auto p = static_cast<const char *>(buf);
+        while (size > 0) {
+            const auto written = send(fd, p, size, MSG_NOSIGNAL);
+            if (written <= 0)
+                throw runtime_error("can't write to socket");
+            p += written;
+            size -= written;
+        }
+    }
+
+    void read_all(int fd, void *buf, size_t size) {
+        auto p = static_cast<char *>(buf);
+        while (size > 0) {
+            const auto received = read(fd, p, size);
+            if (received <= 0)
+                throw runtime_error("can't read from socket");
+            p += received;
+            size -= received;
+        }
+    }
+
+    auto make_socket_address(const string &socket_path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+            throw runtime_error("socket path too long: " + socket_path);
+        copy(socket_path.begin(), socket_path.end(), address.sun_path);
+        return address;
+    }
+
+    // plain threads kept alive across batches. run(n_tasks, task) calls
+    // task(i) for every i in [0, n_tasks) and returns when all are done.
+    // workers are forked and libgomp's thread pool does not survive fork,
+    // so OpenMP is not used here
+    struct BatchThreads {
+        int n_threads;
+        vector<thread> threads;
+        mutex mtx;
+        condition_variable start_cv, done_cv;
+        function<void(int)> task;
+        int n_tasks = 0, n_running = 0;
+        long generation = 0;
+        bool stopped = false;
+
+        BatchThreads(int n_threads = count_cpus()) : n_threads(max(1, n_threads)) {
+            for (int thread_id = 0; thread_id < this->n_threads; ++thread_id) {
+                threads.emplace_back([this, thread_id]() { work(thread_id); });
+            }
+        }
+
+        BatchThreads(const BatchThreads &) = delete;
+
+        BatchThreads &operator=(const BatchThreads &) = delete;
+
+        ~BatchThreads() {
+            {
+                lock_guard<mutex> lock(mtx);
+                stopped = true;
+            }
+            start_cv.notify_all();
+            for (auto &t : threads) t.join();
+        }
+
+        void work(int thread_id) {
+            long seen = 0;
+            while (true) {
+                {
+                    unique_lock<mutex> lock(mtx);
+                    start_cv.wait(lock, [&]() { return stopped || generation != seen; });
+                    if (stopped) return;
+                    seen = generation;
+                }
+
+                for (int i = thread_id; i < n_tasks; i += n_threads) task(i);
+
+                lock_guard<mutex> lock(mtx);
+                if (--n_running == 0) done_cv.notify_one();
+            }
+        }
+
+        template<typename Task>
+        void run(int n_tasks, Task task) {
+            unique_lock<mutex> lock(mtx);
+            this->task = move(task);
+            this->n_tasks = n_tasks;
+            n_running = n_threads;
+            ++generation;
+            start_cv.notify_all();
+            done_cv.wait(lock, [&]() { return n_running == 0; });
+        }
+    };
+
+    // search a batch of queries on the given threads
+    auto knn_scan_batch(int k, const DataArray &queries, const DataArray &dataset,
+                        BatchThreads &threads) {
+        vector<Neighbors> results(queries.n);
+        threads.run(queries.n, [&](int i) {
+            knn_scan(k, queries.find(i), dataset, results[i]);
+        });
+        return results;
+    }
+
+    auto knn_scan_batch(int k, const DataArray &queries, const DataArray &dataset,
+                        int n_threads = count_cpus()) {
+        BatchThreads threads(min(n_threads, queries.n));
+        return knn_scan_batch(k, queries, dataset, threads);
+    }
+
+    // worker protocol over a unix domain socket:
+    //   request:  int k, int n_queries, float queries[n_queries * dim]
+    //   response: Neighbor results[n_queries * k] (global ids, -1 padded)
+    // n_queries == 0 shuts the worker down
+    void serve_shard(const string &socket_path, const DataArray &shard,
+                     int id_offset) {
+        const auto address = make_socket_address(socket_path);
+        const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socket_path.c_str());
+        if (bind(listen_fd, (const sockaddr *) &address, sizeof(address)) != 0 ||
+            listen(listen_fd, 1) != 0)
+            throw runtime_error("can't listen on " + socket_path);
+
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        if (fd < 0)
+            throw runtime_error("can't accept on " + socket_path);
+
+        // sized by the cpus left after pin_to_numa_node, reused per request
+        BatchThreads threads;
+        while (true) {
+            int header[2];
+            read_all(fd, header, sizeof(header));
+            const int k = header[0], n_queries = header[1];
+            if (n_queries == 0) break;
+
+            auto queries = DataArray(n_queries, shard.dim);
+            read_all(fd, queries.x.data(), queries.x.size() * sizeof(float));
+
+            const auto results = knn_scan_batch(k, queries, shard, threads);
+            Neighbors response(n_queries * k);
+            for (int i = 0; i < n_queries; ++i) {
+                for (int j = 0; j < results[i].size(); ++j) {
+                    response[i * k + j] = Neighbor(results[i][j].dist,
+                                                   results[i][j].id + id_offset);
+                }
+            }
+            write_all(fd, response.data(), response.size() * sizeof(Neighbor));
+        }
+        close(fd);
+    }
+
+    // coordinator of a sharded search. each shard of the base file is
+    // served by a forked worker process pinned to a NUMA node, and the
+    // per-shard results are merged into global top-k
+    struct ShardedSearch {
+        int dim;
+        string prefix;
+        vector<int> offsets;
+        vector<pid_t> workers;
+        vector<int> sockets;
+
+        ShardedSearch(const string &base_path, int n, int dim, int n_shards,
+                      const string &work_dir = "/tmp") :
+                dim(dim), prefix(work_dir + "/cpputil_shard_" + to_string(getpid())) {
+            try {
+                offsets = partition_fvecs(base_path, n, dim, n_shards, prefix);
+
+                // fork every worker first so that shards load concurrently
+                const auto n_nodes = count_numa_nodes();
+                for (int shard_id = 0; shard_id < n_shards; ++shard_id) {
+                    const auto pid = fork();
+                    if (pid < 0)
+                        throw runtime_error("can't fork worker");
+                    if (pid == 0) run_worker(shard_id, n_nodes);
+                    workers.emplace_back(pid);
+                }
+
+                for (int shard_id = 0; shard_id < n_shards; ++shard_id) {
+                    sockets.emplace_back(connect_worker(socket_path(shard_id), workers[shard_id]));
+                }
+            } catch (...) {
+                terminate_workers(n_shards);
+                throw;
+            }
+        }
+
+        ShardedSearch(const ShardedSearch &) = delete;
+
+        ShardedSearch &operator=(const ShardedSearch &) = delete;
+
+        ~ShardedSearch() {
+            const int header[2] = {0, 0};
+            for (const auto fd : sockets) {
+                try { write_all(fd, header, sizeof(header)); } catch (...) {}
+                close(fd);
+            }
+            for (const auto pid : workers) waitpid(pid, nullptr, 0);
+        }
+
+        string shard_path(int shard_id) const {
+            return prefix + '.' + to_string(shard_id) + ".fvecs";
+        }
+
+        string socket_path(int shard_id) const {
+            return prefix + '.' + to_string(shard_id) + ".sock";
+        }
+
+        [[noreturn]] void run_worker(int shard_id, int n_nodes) {
+            int status = 0;
+            try {
+                if (n_nodes > 0) pin_to_numa_node(shard_id % n_nodes);
+                auto shard = DataArray(offsets[shard_id + 1] - offsets[shard_id], dim);
+                shard.load(shard_path(shard_id));
+                serve_shard(socket_path(shard_id), shard, offsets[shard_id]);
+            } catch (const exception &e) {
+                cerr << e.what() << endl;
+                status = 1;
+            }
+            unlink(shard_path(shard_id).c_str());
+            _exit(status);
+        }
+
+        // cleanup of a failed start: close connections, kill and reap the
+        // workers and remove their files
+        void terminate_workers(int n_shards) noexcept {
+            for (const auto fd : sockets) close(fd);
+            for (const auto pid : workers) kill(pid, SIGKILL);
+            for (const auto pid : workers) waitpid(pid, nullptr, 0);
+            for (int shard_id = 0; shard_id < n_shards; ++shard_id) {
+                unlink(shard_path(shard_id).c_str());
+                unlink(socket_path(shard_id).c_str());
+            }
+            sockets.clear();
+            workers.clear();
+        }
+
+        static int connect_worker(const string &socket_path, pid_t pid,
+                                  int timeout_ms = 60000) {
+            const auto address = make_socket_address(socket_path);
+            // the worker may still be loading its shard
+            for (int elapsed = 0; elapsed < timeout_ms; elapsed += 10) {
+                const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (connect(fd, (const sockaddr *) &address, sizeof(address)) == 0)
+                    return fd;
+                close(fd);
+
+                // fail fast if the worker is gone. it stays unreaped so the
+                // cleanup can still waitpid it
+                siginfo_t info{};
+                if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+                    info.si_pid == pid)
+                    throw runtime_error("worker exited: " + socket_path);
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+            throw runtime_error("can't connect to worker: " + socket_path);
+        }
+
+        auto search(int k, const DataArray &queries) {
+            if (queries.dim != dim)
+                throw runtime_error("dimension not matched");
+
+            const int header[2] = {k, queries.n};
+            for (const auto fd : sockets) {
+                write_all(fd, header, sizeof(header));
+                write_all(fd, queries.x.data(), queries.x.size() * sizeof(float));
+            }
+
+            vector<Neighbors> responses(sockets.size(), Neighbors(queries.n * k));
+            for (int shard_id = 0; shard_id < sockets.size(); ++shard_id) {
+                read_all(sockets[shard_id], responses[shard_id].data(),
+                         responses[shard_id].size() * sizeof(Neighbor));
+            }
+
+            vector<Neighbors> results(queries.n);
+            vector<Neighbors> lists(sockets.size());
+            for (int i = 0; i < queries.n; ++i) {
+                for (int shard_id = 0; shard_id < sockets.size(); ++shard_id) {
+                    const auto head = next(responses[shard_id].begin(), i * k);
+                    lists[shard_id].assign(head, next(head, k));
+                }
+                results[i] = merge_neighbors(lists, k);
+            }
+            return results;
+        }
+    };
+
+    // search time for 1 to max_shards shards over the same base file
+    auto benchmark_sharded_search(const string &base_path, int n, int dim,
+                                  int k, const DataArray &queries,
+                                  const GroundTruth &gt, int max_shards,
+                                  const string &work_dir = "/tmp") {
+        vector<SearchReport> reports;
+        for (int n_shards = 1; n_shards <= max_shards; ++n_shards) {
+            ShardedSearch sharded(base_path, n, dim, n_shards, work_dir);
+
+            const auto start = get_now();
+            const auto results = sharded.search(k, queries);
+            const auto end = get_now();
+
+            float recall = 0;
+            for (int i = 0; i < queries.n; ++i) {
+                recall += calc_recall(results[i], gt.x[i], k);
+            }
+
+            SearchReport report{};
+            report.recall = recall / queries.n;
+            report.time = get_duration(start, end);
+            report.qps = queries.n / (max(report.time, 1L) / 1e6f);
+            reports.emplace_back(report);
+        }
+        return reports;
+    }
+
+    // packed binary codes, one bit per dimension
+    struct BinaryCodes {
+        int n, dim, n_words;
+        vector<uint64_t> x;
+
+        BinaryCodes(int n, int dim) :
+                n(n), dim(dim), n_words((dim + 63) / 64), x(size_t(n) * n_words, 0) {}
+
+        const uint64_t *find(int i) const { return &x[size_t(i) * n_words]; }
+
+        uint64_t *find(int i) { return &x[size_t(i) * n_words]; }
+    };
+
+    // 1-bit sign code of each row
+    auto encode_binary(const DataArray &dataset) {
+        auto codes = BinaryCodes(dataset.n, dataset.dim);
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < dataset.n; ++i) {
+            const auto data = dataset.find(i);
+            const auto code = codes.find(i);
+            for (int j = 0; j < dataset.dim; ++j) {
+                if (data[j] > 0) code[j / 64] |= uint64_t(1) << (j % 64);
+            }
+        }
+        return codes;
+    }
+
+    // sign code after a projection, e.g. PCA hashing with fit_pca or
+    // a random rotation with random_projection
+    auto encode_binary(const DataArray &dataset, const Projection &projection) {
+        return encode_binary(projection.transform(dataset));
+    }
+
+    int hamming_dist_scalar(const uint64_t *a, const uint64_t *b, int n_words) {
+        int result = 0;
+        for (int i = 0; i < n_words; ++i) {
+            result += __builtin_popcountll(a[i] ^ b[i]);
+        }
+        return result;
+    }
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+
+    int hamming_dist_avx512(const uint64_t *a, const uint64_t *b, int n_words) {
+        __m512i msum = _mm512_setzero_si512();
+        int i = 0;
+        for (; i + 8 <= n_words; i += 8) {
+            const __m512i ma = _mm512_loadu_si512(a + i);
+            const __m512i mb = _mm512_loadu_si512(b + i);
+            msum = _mm512_add_epi64(msum, _mm512_popcnt_epi64(_mm512_xor_si512(ma, mb)));
+        }
+
+        // masked load for the remaining words
+        if (i < n_words) {
+            const __mmask8 mask = (1u << (n_words - i)) - 1;
+            const __m512i ma = _mm512_maskz_loadu_epi64(mask, a + i);
+            const __m512i mb = _mm512_maskz_loadu_epi64(mask, b + i);
+            msum = _mm512_add_epi64(msum, _mm512_popcnt_epi64(_mm512_xor_si512(ma, mb)));
+        }
+        return _mm512_reduce_add_epi64(msum);
+    }
+
+    // distances from query to the 8 codes starting at row first, one code
+    // per 64-bit lane. single-word codes are one contiguous load, longer ones
+    // are gathered word by word (used below 8 words, where the per-code
+    // kernel can't fill a register)
+    void hamming_dist_block8_avx512(const uint64_t *query, const BinaryCodes &codes,
+                                    int first, int *dists) {
+        const auto base = (const long long *) codes.find(first);
+        if (codes.n_words == 1) {
+            const __m512i mx = _mm512_loadu_si512(base);
+            const __m512i count = _mm512_popcnt_epi64(
+                    _mm512_xor_si512(mx, _mm512_set1_epi64(query[0])));
+            _mm256_storeu_si256((__m256i *) dists, _mm512_cvtepi64_epi32(count));
+            return;
+        }
+
+        const long long w = codes.n_words;
+        __m512i index = _mm512_setr_epi64(0, w, 2 * w, 3 * w, 4 * w, 5 * w, 6 * w, 7 * w);
+        const __m512i one = _mm512_set1_epi64(1);
+        __m512i msum = _mm512_setzero_si512();
+        for (int i = 0; i < codes.n_words; ++i) {
+            const __m512i mx = _mm512_i64gather_epi64(index, base, 8);
+            const __m512i mq = _mm512_set1_epi64(query[i]);
+            msum = _mm512_add_epi64(msum, _mm512_popcnt_epi64(_mm512_xor_si512(mx, mq)));
+            index = _mm512_add_epi64(index, one);
+        }
+        _mm256_storeu_si256((__m256i *) dists, _mm512_cvtepi64_epi32(msum));
+    }
+
+#endif
+
+    int hamming_dist(const uint64_t *a, const uint64_t *b, int n_words) {
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+        if (n_words >= 4) return hamming_dist_avx512(a, b, n_words);
+#endif
+        return hamming_dist_scalar(a, b, n_words);
+    }
+
+    void hamming_knn_scan(int k, const uint64_t *query, const BinaryCodes &codes,
+                          Neighbors &result,
+                          SearchBuffer &buffer = get_search_buffer()) {
+        buffer.reset(k);
+        auto &heap = buffer.candidates;
+
+        int data_id = 0;
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+        int dists[8];
+        for (; codes.n_words < 8 && data_id + 8 <= codes.n; data_id += 8) {
+            hamming_dist_block8_avx512(query, codes, data_id, dists);
+
+            // most blocks have no code closer than the current k-th
+            const int bound = (heap.size() < k) ? int_max : heap.front().dist;
+            const __m256i closer = _mm256_cmpgt_epi32(_mm256_set1_epi32(bound),
+                                                      _mm256_loadu_si256((const __m256i *) dists));
+            if (_mm256_testz_si256(closer, closer)) continue;
+            for (int j = 0; j < 8; ++j) push_candidate(heap, k, dists[j], data_id + j);
+        }
+#endif
+        for (; data_id < codes.n; ++data_id) {
+            const auto dist = hamming_dist(query, codes.find(data_id), codes.n_words);
+            push_candidate(heap, k, dist, data_id);
+        }
+
+        sort_heap(heap.begin(), heap.end(), CompLess());
+        result.assign(heap.begin(), heap.end());
+    }
+
+    auto hamming_knn_scan(int k, const uint64_t *query, const BinaryCodes &codes) {
+        Neighbors result;
+        hamming_knn_scan(k, query, codes, result);
+        return result;
+    }
+
+    // all codes within radius, nearest first
+    auto hamming_range_search(const uint64_t *query, const BinaryCodes &codes,
+                              int radius) {
+        Neighbors result;
+        for (int data_id = 0; data_id < codes.n; ++data_id) {
+            const auto dist = hamming_dist(query, codes.find(data_id), codes.n_words);
+            if (dist <= radius) result.emplace_back(dist, data_id);
+        }
+        stable_sort(result.begin(), result.end(), CompLess());
+        return result;
+    }
+
+    // first stage on binary codes, then rerank with l2_dist
+    auto hamming_knn_rerank(int k, int n_candidates, const uint64_t *query_code,
+                            const BinaryCodes &codes, DataArray::Data query,
+                            const DataArray &dataset) {
+        Neighbors candidates;
+        hamming_knn_scan(n_candidates, query_code, codes, candidates);
+
+        for (auto &candidate : candidates) {
+            candidate.dist = l2_dist(query, dataset.find(candidate.id), dataset.dim);
+        }
+        sort_neighbors(candidates);
+        if (candidates.size() > k) candidates.resize(k);
+        return candidates;
+    }
+
+    // hamming_knn_scan throughput in codes per second, with the queries
+    // searched in parallel
+    auto benchmark_hamming_scan(int k, const BinaryCodes &queries, const BinaryCodes &codes) {
+        vector<Neighbors> results(queries.n);
+
+        const auto start = get_now();
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < queries.n; ++i) {
+            hamming_knn_scan(k, queries.find(i), codes, results[i]);
+        }
+        const auto time = get_duration(start, get_now());
+        return static_cast<double>(queries.n) * codes.n / (max(time, 1L) / 1e6);
+    }
+
+    // token vectors of many documents stored in one DataArray.
+    // document i owns rows [offsets[i], offsets[i + 1])
+    struct MultiVectorArray {
+        DataArray vectors;
+        vector<int> offsets;
+
+        MultiVectorArray(DataArray vectors, vector<int> offsets) :
+                vectors(move(vectors)), offsets(move(offsets)) {
+            if (this->offsets.empty() || this->offsets.front() != 0 ||
+                this->offsets.back() != this->vectors.n ||
+                !is_sorted(this->offsets.begin(), this->offsets.end()))
+                throw runtime_error("invalid document offsets");
+        }
+
+        static auto from_lengths(DataArray vectors, const vector<int> &lengths) {
+            vector<int> offsets(lengths.size() + 1, 0);
+            partial_sum(lengths.begin(), lengths.end(), next(offsets.begin()));
+            return MultiVectorArray(move(vectors), offsets);
+        }
+
+        int n_docs() const { return offsets.size() - 1; }
+
+        int n_tokens(int doc_id) const { return offsets[doc_id + 1] - offsets[doc_id]; }
+    };
+
+    // late interaction score: sum over query tokens of the max inner
+    // product with any token of the document. an empty document scores
+    // -float_max so it ranks below every real document
+    float max_sim(const DataArray &query_tokens, const MultiVectorArray &docs,
+                  int doc_id) {
+        const int dim = query_tokens.dim;
+        const auto &vectors = docs.vectors;
+        const int begin = docs.offsets[doc_id], end = docs.offsets[doc_id + 1];
+        if (begin == end) return -float_max;
+
+        float score = 0;
+        for (int q = 0; q < query_tokens.n; ++q) {
+            const auto query = query_tokens.find(q);
+            float max_ip = -float_max;
+            int t = begin;
+#ifdef __AVX__
+            float ips[4];
+            for (; t + 4 <= end; t += 4) {
+                ip_block4_avx(&(*query), &*vectors.find(t), &*vectors.find(t + 1),
+                              &*vectors.find(t + 2), &*vectors.find(t + 3), dim, ips);
+                max_ip = max({max_ip, ips[0], ips[1], ips[2], ips[3]});
+            }
+#endif
+            for (; t < end; ++t) {
+                max_ip = max(max_ip, inner_product(query, vectors.find(t), dim));
+            }
+            score += max_ip;
+        }
+        return score;
+    }
+
+    // top-k documents by max_sim, reported like "ip" (larger first).
+    // documents are scored on n_threads OpenMP threads
+    void maxsim_search(int k, const DataArray &query_tokens,
+                       const MultiVectorArray &docs, Neighbors &result,
+                       SearchBuffer &buffer = get_search_buffer(),
+                       int n_threads = omp_get_max_threads()) {
+        if (query_tokens.dim != docs.vectors.dim)
+            throw runtime_error("dimension not matched");
+
+        auto &scores = buffer.scores;
+        scores.resize(docs.n_docs());
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 64)
+        for (int doc_id = 0; doc_id < docs.n_docs(); ++doc_id) {
+            scores[doc_id] = max_sim(query_tokens, docs, doc_id);
+        }
+
+        buffer.reset(k);
+        auto &heap = buffer.candidates;
+        for (int doc_id = 0; doc_id < docs.n_docs(); ++doc_id) {
+            push_candidate(heap, k, -scores[doc_id], doc_id);
+        }
+
+        sort_heap(heap.begin(), heap.end(), CompLess());
+        result.assign(heap.begin(), heap.end());
+        for (auto &neighbor : result) neighbor.dist = -neighbor.dist;
+    }
+
+    auto maxsim_search(int k, const DataArray &query_tokens,
+                       const MultiVectorArray &docs) {
+        Neighbors result;
+        maxsim_search(k, query_tokens, docs, result);
+        return result;
+    }
+
+    // batch of queries on the given threads like knn_scan_batch, each query
+    // scored by a single thread
+    auto maxsim_search_batch(int k, const vector<DataArray> &queries,
+                             const MultiVectorArray &docs, BatchThreads &threads) {
+        vector<Neighbors> results(queries.size());
+        threads.run(queries.size(), [&](int i) {
+            maxsim_search(k, queries[i], docs, results[i], get_search_buffer(), 1);
+        });
+        return results;
+    }
+
+    auto maxsim_search_batch(int k, const vector<DataArray> &queries,
+                             const MultiVectorArray &docs, int n_threads = count_cpus()) {
+        BatchThreads threads(min<int>(n_threads, queries.size()));
+        return maxsim_search_batch(k, queries, docs, threads);
+    }
+
+    // best-first search over a neighbor graph (e.g. load_neighbors output)
+    // keeping pool_size candidates. the vectors of upcoming neighbors and the
+    // neighbor list of the next node to expand are prefetched
+    void graph_search(int k, int pool_size, DataArray::Data query,
+                      const DataArray &dataset, const vector<Neighbors> &graph,
+                      int start_id, Neighbors &result,
+                      SearchBuffer &buffer = get_search_buffer()) {
+        const int dim = dataset.dim;
+        const int distance = buffer.prefetch_distance;
+        pool_size = max(pool_size, k);
+
+        buffer.reset(pool_size);
+        buffer.visited.reset(dataset.n);
+        auto &top = buffer.candidates;  // max heap of the best pool_size
+        auto &frontier = buffer.pool;   // min heap of nodes to expand
+
+        const auto start_dist = l2_sqr(query, dataset.find(start_id), dim);
+        buffer.visited.insert(start_id);
+        frontier.emplace_back(start_dist, start_id);
+        push_candidate(top, pool_size, start_dist, start_id);
+
+        while (!frontier.empty()) {
+            pop_heap(frontier.begin(), frontier.end(), CompGreater());
+            const auto current = frontier.back();
+            frontier.pop_back();
+            if (top.size() == pool_size && current.dist > top.front().dist) break;
+
+            const auto &neighbors = graph[current.id];
+            const int degree = neighbors.size();
+            for (int i = 0; i < min(distance, degree); ++i) {
+                prefetch_row(&*dataset.find(neighbors[i].id), dim);
+            }
+
+            // unvisited neighbors are scored 4 at a time
+            int batch[4];
+            int n_batch = 0;
+            const auto flush = [&]() {
+                float dists[4];
+#ifdef __AVX__
+                if (n_batch == 4) {
+                    l2_sqr_block4_avx(&(*query), &*dataset.find(batch[0]),
+                                      &*dataset.find(batch[1]), &*dataset.find(batch[2]),
+                                      &*dataset.find(batch[3]), dim, dists);
+                } else
+#endif
+                {
+                    for (int b = 0; b < n_batch; ++b) {
+                        dists[b] = l2_sqr(query, dataset.find(batch[b]), dim);
+                    }
+                }
+
+                for (int b = 0; b < n_batch; ++b) {
+                    if (top.size() == pool_size && dists[b] >= top.front().dist) continue;
+                    frontier.emplace_back(dists[b], batch[b]);
+                    push_heap(frontier.begin(), frontier.end(), CompGreater());
+                    push_candidate(top, pool_size, dists[b], batch[b]);
+                }
+                n_batch = 0;
+            };
+
+            for (int i = 0; i < degree; ++i) {
+                if (i + distance < degree)
+                    prefetch_row(&*dataset.find(neighbors[i + distance].id), dim);
+
+                const auto id = neighbors[i].id;
+                if (!buffer.visited.insert(id)) continue;
+
+                batch[n_batch++] = id;
+                if (n_batch == 4) flush();
+            }
+            flush();
+
+            if (!frontier.empty())
+                _mm_prefetch(reinterpret_cast<const char *>(graph[frontier.front().id].data()),
+                             _MM_HINT_T0);
+        }
+
+        sort_heap(top.begin(), top.end(), CompLess());
+        result.assign(top.begin(), next(top.begin(), min<int>(k, top.size())));
+        for (auto &neighbor : result) neighbor.dist = sqrt(neighbor.dist);
+    }
+
+    auto graph_search(int k, int pool_size, DataArray::Data query,
+                      const DataArray &dataset, const vector<Neighbors> &graph,
+                      int start_id = 0) {
+        Neighbors result;
+        graph_search(k, pool_size, query, dataset, graph, start_id, result);
+        return result;
+    }
+
+    // perf_event config of a hardware cache event, e.g.
+    // perf_cache_config(PERF_COUNT_HW_CACHE_DTLB) for dTLB read misses
+    auto perf_cache_config(unsigned long long cache,
+                           unsigned long long op = PERF_COUNT_HW_CACHE_OP_READ,
+                           unsigned long long result = PERF_COUNT_HW_CACHE_RESULT_MISS) {
+        return cache | (op << 8) | (result << 16);
+    }
+
+    // count a hardware event of the calling thread while func runs
+    template<typename Func>
+    auto count_event(Func func, unsigned int type = PERF_TYPE_HARDWARE,
+                     unsigned long long config = PERF_COUNT_HW_CACHE_MISSES) {
+        PerfCounter counter(type, config);
+        counter.start();
+        func();
+        return counter.stop();
+    }
+
+    // evaluate_search with cache misses and dTLB read misses of the calling
+    // thread counted via perf_event_open, -1 if a counter is unavailable
+    template<typename Search>
+    auto evaluate_search_perf(int k, int n_queries, const GroundTruth &gt, Search search,
+                              long long &cache_misses, long long &dtlb_misses) {
+        unique_ptr<PerfCounter> cache_counter, dtlb_counter;
+        try {
+            cache_counter = make_unique<PerfCounter>();
+        } catch (const runtime_error &) {}
+        try {
+            dtlb_counter = make_unique<PerfCounter>(PERF_TYPE_HW_CACHE,
+                                                    perf_cache_config(PERF_COUNT_HW_CACHE_DTLB));
+        } catch (const runtime_error &) {}
+
+        if (cache_counter) cache_counter->start();
+        if (dtlb_counter) dtlb_counter->start();
+        const auto report = evaluate_search(k, n_queries, gt, search);
+        dtlb_misses = dtlb_counter ? dtlb_counter->stop() : -1;
+        cache_misses = cache_counter ? cache_counter->stop() : -1;
+        return report;
+    }
+
+    // CRC-32C (Castagnoli), with the SSE4.2 instruction when available
+    uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0) {
+        auto p = static_cast<const uint8_t *>(data);
+        crc = ~crc;
+#ifdef __SSE4_2__
+        uint64_t crc64 = crc;
+        for (; size >= 8; p += 8, size -= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+        crc = crc64;
+        for (; size > 0; ++p, --size) crc = _mm_crc32_u8(crc, *p);
+#else
+        for (; size > 0; ++p, --size) {
+            crc ^= *p;
+            for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+#endif
+        return ~crc;
+    }
+
+    // CRC-32C over the CRC-32C of each 1 MiB block, so that large sections
+    // are checked in parallel
+    uint64_t calc_checksum(const void *data, size_t size) {
+        constexpr size_t block_size = 1 << 20;
+        const long n_blocks = (size + block_size - 1) / block_size;
+        const auto p = static_cast<const char *>(data);
+
+        vector<uint32_t> block_crcs(n_blocks);
+#pragma omp parallel for schedule(dynamic)
+        for (long i = 0; i < n_blocks; ++i) {
+            block_crcs[i] = crc32c(p + i * block_size, min(block_size, size - i * block_size));
+        }
+        return crc32c(block_crcs.data(), block_crcs.size() * sizeof(uint32_t));
+    }
+
+    // binary container of named sections:
+    //   header  (IndexHeader, first page)
+    //   section payloads, each starting on a page boundary
+    //   section table (SectionEntry x n_sections)
+    // every payload and the table are checksummed. payloads can be used in
+    // place from a read-only mmap of the file with IndexReader::data, the
+    // load_* functions copy them into the owning types
+    constexpr uint32_t index_format_version = 1;
+    constexpr size_t index_page_size = 4096;
+    constexpr char index_magic[8] = {'C', 'P', 'P', 'U', 'T', 'I', 'L', 'X'};
+
+    enum class SectionType : uint32_t {
+        raw, float32, int32, neighbors, binary_codes, json
+    };
+
+    struct IndexHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_sections;
+        uint64_t table_offset;
+        uint64_t table_checksum;
+    };
+
+    // bits of SectionEntry::reserved
+    constexpr uint32_t section_normalized = 1;
+
+    struct SectionEntry {
+        char name[40];
+        SectionType type;
+        uint32_t reserved;  // flags, e.g. section_normalized
+        uint64_t offset, size, checksum;
+        int64_t rows, cols;
+    };
+
+    struct IndexWriter {
+        ofstream ofs;
+        vector<SectionEntry> sections;
+
+        IndexWriter(const string &path) : ofs(path, ios::binary) {
+            if (!ofs)
+                throw runtime_error("can't open file: " + path);
+            // the header is written on close
+            const vector<char> zeros(index_page_size, 0);
+            ofs.write(zeros.data(), zeros.size());
+        }
+
+        IndexWriter(const IndexWriter &) = delete;
+
+        IndexWriter &operator=(const IndexWriter &) = delete;
+
+        // errors are swallowed here. call close() to see them
+        ~IndexWriter() noexcept {
+            try {
+                if (ofs.is_open()) close();
+            } catch (...) {}
+        }
+
+        void pad_to_page() {
+            const auto pos = static_cast<size_t>(ofs.tellp());
+            const auto padding = (index_page_size - pos % index_page_size) % index_page_size;
+            const vector<char> zeros(padding, 0);
+            ofs.write(zeros.data(), zeros.size());
+        }
+
+        void add(const string &name, SectionType type, const void *data,
+                 size_t size, int64_t rows = 0, int64_t cols = 0) {
+            SectionEntry entry{};
+            if (name.size() >= sizeof(entry.name))
+                throw runtime_error("section name too long: " + name);
+            for (const auto &section : sections) {
+                if (name == section.name)
+                    throw runtime_error("duplicated section: " + name);
+            }
+
+            copy(name.begin(), name.end(), entry.name);
+            entry.type = type;
+            entry.offset = ofs.tellp();
+            entry.size = size;
+            entry.checksum = calc_checksum(data, size);
+            entry.rows = rows;
+            entry.cols = cols;
+
+            ofs.write(static_cast<const char *>(data), size);
+            pad_to_page();
+            sections.emplace_back(entry);
+        }
+
+        void add(const string &name, const DataArray &dataset) {
+            add(name, SectionType::float32, dataset.x.data(),
+                dataset.x.size() * sizeof(float), dataset.n, dataset.dim);
+            if (dataset.normalized) sections.back().reserved |= section_normalized;
+        }
+
+        void add(const string &name, const GroundTruth &gt) {
+            vector<int> flat(static_cast<size_t>(gt.n) * gt.k, -1);
+            for (int i = 0; i < gt.n; ++i) {
+                copy_n(gt.x[i].begin(), min<size_t>(gt.k, gt.x[i].size()),
+                       next(flat.begin(), static_cast<size_t>(i) * gt.k));
+            }
+            add(name, SectionType::int32, flat.data(), flat.size() * sizeof(int), gt.n, gt.k);
+        }
+
+        // neighbor lists as CSR: int64 offsets[n + 1], then all Neighbor
+        void add(const string &name, const vector<Neighbors> &graph) {
+            vector<int64_t> offsets(graph.size() + 1, 0);
+            for (size_t i = 0; i < graph.size(); ++i) {
+                offsets[i + 1] = offsets[i] + graph[i].size();
+            }
+
+            vector<char> payload(offsets.size() * sizeof(int64_t) + offsets.back() * sizeof(Neighbor));
+            memcpy(payload.data(), offsets.data(), offsets.size() * sizeof(int64_t));
+            auto edges = payload.data() + offsets.size() * sizeof(int64_t);
+            for (const auto &neighbors : graph) {
+                memcpy(edges, neighbors.data(), neighbors.size() * sizeof(Neighbor));
+                edges += neighbors.size() * sizeof(Neighbor);
+            }
+            add(name, SectionType::neighbors, payload.data(), payload.size(),
+                graph.size(), offsets.back());
+        }
+
+        void add(const string &name, const BinaryCodes &codes) {
+            add(name, SectionType::binary_codes, codes.x.data(),
+                codes.x.size() * sizeof(uint64_t), codes.n, codes.dim);
+        }
+
+        void add(const string &name, const json &metadata) {
+            const auto dumped = metadata.dump();
+            add(name, SectionType::json, dumped.data(), dumped.size());
+        }
+
+        void close() {
+            IndexHeader header{};
+            copy(begin(index_magic), end(index_magic), header.magic);
+            header.version = index_format_version;
+            header.n_sections = sections.size();
+            header.table_offset = ofs.tellp();
+            header.table_checksum = calc_checksum(sections.data(),
+                                                  sections.size() * sizeof(SectionEntry));
+
+            ofs.write((const char *) sections.data(), sections.size() * sizeof(SectionEntry));
+            ofs.seekp(0);
+            ofs.write((const char *) &header, sizeof(header));
+            ofs.close();
+            if (!ofs)
+                throw runtime_error("can't write index");
+        }
+    };
+
+    struct IndexReader {
+        int fd = -1;
+        const char *base = nullptr;
+        size_t file_size = 0;
+        IndexHeader header{};
+        vector<SectionEntry> sections;
+
+        // with verify, every payload checksum is checked up front. otherwise
+        // only the header and the section table are, and payloads are paged
+        // in on first access
+        IndexReader(const string &path, bool verify = true) {
+            fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw runtime_error("can't open file: " + path);
+
+            struct stat st{};
+            fstat(fd, &st);
+            file_size = st.st_size;
+            if (file_size < sizeof(IndexHeader)) {
+                ::close(fd);
+                throw runtime_error("invalid index file: " + path);
+            }
+
+            const auto p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw runtime_error("can't mmap file: " + path);
+            }
+            base = static_cast<const char *>(p);
+
+            try {
+                validate(verify);
+            } catch (...) {
+                release();
+                throw;
+            }
+        }
+
+        IndexReader(const IndexReader &) = delete;
+
+        IndexReader &operator=(const IndexReader &) = delete;
+
+        ~IndexReader() { release(); }
+
+        void release() {
+            if (base != nullptr) munmap(const_cast<char *>(base), file_size);
+            if (fd >= 0) ::close(fd);
+            base = nullptr;
+            fd = -1;
+        }
+
+        void validate(bool verify) {
+            memcpy(&header, base, sizeof(header));
+            if (!equal(begin(index_magic), end(index_magic), header.magic))
+                throw runtime_error("invalid index file");
+            if (header.version > index_format_version)
+                throw runtime_error("unsupported index version: " + to_string(header.version));
+
+            const auto table_size = header.n_sections * sizeof(SectionEntry);
+            if (header.table_offset + table_size > file_size)
+                throw runtime_error("truncated index file");
+            if (calc_checksum(base + header.table_offset, table_size) != header.table_checksum)
+                throw runtime_error("section table checksum not matched");
+
+            sections.resize(header.n_sections);
+            memcpy(sections.data(), base + header.table_offset, table_size);
+
+            for (const auto &section : sections) {
+                if (memchr(section.name, 0, sizeof(section.name)) == nullptr)
+                    throw runtime_error("section name not terminated");
+                if (section.offset % index_page_size != 0)
+                    throw runtime_error("section not page aligned: " + string(section.name));
+                if (section.offset > header.table_offset ||
+                    section.size > header.table_offset - section.offset)
+                    throw runtime_error("truncated section: " + string(section.name));
+                check_shape(section);
+                if (verify && calc_checksum(base + section.offset, section.size) != section.checksum)
+                    throw runtime_error("checksum not matched: " + string(section.name));
+            }
+        }
+
+        // payload size implied by rows and cols
+        static void check_shape(const SectionEntry &section) {
+            const auto rows = static_cast<unsigned __int128>(section.rows);
+            const auto cols = static_cast<unsigned __int128>(section.cols);
+            bool valid = section.rows >= 0 && section.cols >= 0;
+            switch (section.type) {
+                case SectionType::float32:
+                case SectionType::int32:
+                    valid = valid && section.rows <= int_max && section.cols <= int_max &&
+                            rows * cols * 4 == section.size;
+                    break;
+                case SectionType::binary_codes:
+                    valid = valid && section.rows <= int_max && section.cols <= int_max &&
+                            rows * ((cols + 63) / 64) * sizeof(uint64_t) == section.size;
+                    break;
+                case SectionType::neighbors:
+                    valid = valid && (rows + 1) * sizeof(int64_t) + cols * sizeof(Neighbor) ==
+                                     section.size;
+                    break;
+                default:
+                    break;
+            }
+            if (!valid)
+                throw runtime_error("section size not matched: " + string(section.name));
+        }
+
+        bool contains(const string &name) const {
+            return any_of(sections.begin(), sections.end(),
+                          [&](const auto &section) { return name == section.name; });
+        }
+
+        const SectionEntry &find_section(const string &name, SectionType type) const {
+            for (const auto &section : sections) {
+                if (name != section.name) continue;
+                if (section.type != type)
+                    throw runtime_error("section type not matched: " + name);
+                return section;
+            }
+            throw runtime_error("section not found: " + name);
+        }
+
+        // payload in the mapping, valid while the reader is alive
+        template<typename T>
+        const T *data(const string &name, SectionType type) const {
+            const auto &section = find_section(name, type);
+            return reinterpret_cast<const T *>(base + section.offset);
+        }
+
+        auto load_data_array(const string &name) const {
+            const auto &section = find_section(name, SectionType::float32);
+            auto dataset = DataArray(section.rows, section.cols);
+            memcpy(dataset.x.data(), base + section.offset, section.size);
+            dataset.normalized = section.reserved & section_normalized;
+            return dataset;
+        }
+
+        auto load_ground_truth(const string &name) const {
+            const auto &section = find_section(name, SectionType::int32);
+            const auto flat = reinterpret_cast<const int *>(base + section.offset);
+
+            auto gt = GroundTruth(section.rows, section.cols);
+            for (int i = 0; i < gt.n; ++i) {
+                const auto row = flat + static_cast<size_t>(i) * gt.k;
+                gt.x[i].assign(row, find(row, row + gt.k, -1));
+            }
+            return gt;
+        }
+
+        auto load_graph(const string &name) const {
+            const auto &section = find_section(name, SectionType::neighbors);
+            const auto offsets = reinterpret_cast<const int64_t *>(base + section.offset);
+            const auto edges = reinterpret_cast<const Neighbor *>(offsets + section.rows + 1);
+            if (offsets[0] != 0 || offsets[section.rows] != section.cols ||
+                !is_sorted(offsets, offsets + section.rows + 1))
+                throw runtime_error("invalid graph offsets: " + name);
+
+            vector<Neighbors> graph(section.rows);
+            for (int64_t i = 0; i < section.rows; ++i) {
+                graph[i].assign(edges + offsets[i], edges + offsets[i + 1]);
+            }
+            return graph;
+        }
+
+        auto load_binary_codes(const string &name) const {
+            const auto &section = find_section(name, SectionType::binary_codes);
+            auto codes = BinaryCodes(section.rows, section.cols);
+            memcpy(codes.x.data(), base + section.offset, section.size);
+            return codes;
+        }
+
+        auto load_json(const string &name) const {
+            const auto &section = find_section(name, SectionType::json);
+            return json::parse(base + section.offset, base + section.offset + section.size);
+        }
+    };
+
+    struct ReorderReport {
+        SearchReport before, after;
+        long long cache_misses_before, cache_misses_after;  // -1 if unavailable
+    };
+
+    // graph_search over the original rows and over the rows permuted by
+    // order (ids restored), with cache misses counted via perf_event_open
+    auto benchmark_reorder(int k, int pool_size, const DataArray &dataset,
+                           const vector<Neighbors> &graph, const DataArray &queries,
+                           const GroundTruth &gt, const vector<int> &order,
+                           int start_id = 0) {
+        const auto reordered = reorder(dataset, order);
+        const auto reordered_graph = reorder(graph, order);
+        const auto reordered_start_id = inverse_order(order)[start_id];
+
+        const auto run = [&](const DataArray &data, const vector<Neighbors> &g,
+                             int start, bool restore, long long &cache_misses) {
+            const auto search = [&](int query_id) {
+                auto result = graph_search(k, pool_size, queries.find(query_id), data, g, start);
+                if (restore) restore_ids(result, order);
+                return result;
+            };
+
+            long long dtlb_misses;
+            return evaluate_search_perf(k, queries.n, gt, search, cache_misses, dtlb_misses);
+        };
+
+        ReorderReport report{};
+        report.before = run(dataset, graph, start_id, false, report.cache_misses_before);
+        report.after = run(reordered, reordered_graph, reordered_start_id, true,
+                           report.cache_misses_after);
+        return report;
+    }
+
+    struct PrefetchReport {
+        string search;  // "knn_scan" or "graph_search"
+        int prefetch_distance;
+        bool huge_pages;
+        SearchReport report;
+        long long cache_misses, dtlb_misses;  // -1 if unavailable
+    };
+
+    // knn_scan and graph_search with prefetching off and at the default
+    // distance, each over a copy of dataset with and without huge pages
+    auto benchmark_prefetch(int k, int pool_size, const DataArray &dataset,
+                            const vector<Neighbors> &graph, const DataArray &queries,
+                            const GroundTruth &gt, int start_id = 0) {
+        auto &buffer = get_search_buffer();
+        const int default_distance = SearchBuffer().prefetch_distance;
+        const int prefetch_distance = buffer.prefetch_distance;
+
+        vector<PrefetchReport> reports;
+        for (const bool huge_pages : {false, true}) {
+            auto data = DataArray(dataset.n, dataset.dim, huge_pages);
+            copy(dataset.x.begin(), dataset.x.end(), data.x.begin());
+            data.normalized = dataset.normalized;
+
+            const auto scan = [&](int query_id) {
+                return knn_scan(k, queries.find(query_id), data);
+            };
+            const auto graph_walk = [&](int query_id) {
+                return graph_search(k, pool_size, queries.find(query_id), data, graph, start_id);
+            };
+
+            for (const int distance : {0, default_distance}) {
+                buffer.prefetch_distance = distance;
+
+                PrefetchReport scan_report{"knn_scan", distance, huge_pages};
+                scan_report.report = evaluate_search_perf(k, queries.n, gt, scan,
+                                                          scan_report.cache_misses,
+                                                          scan_report.dtlb_misses);
+                reports.emplace_back(scan_report);
+
+                PrefetchReport graph_report{"graph_search", distance, huge_pages};
+                graph_report.report = evaluate_search_perf(k, queries.n, gt, graph_walk,
+                                                           graph_report.cache_misses,
+                                                           graph_report.dtlb_misses);
+                reports.emplace_back(graph_report);
+            }
+        }
+        buffer.prefetch_distance = prefetch_distance;
+        return reports;
+    }
 }
 
-#endif //CPPUTIL_CPPUTIL_HPP
\ No newline at end of file
+#endif //CPPUTIL_CPPUTIL_HPP
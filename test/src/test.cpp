@@ -29,6 +29,33 @@ TEST(Functional, filter_test) {
     ASSERT_EQ(actual, expect);
 }
 
+TEST(Functional, fmap_parallel) {
+    std::vector<int> v(10000);
+    std::iota(v.begin(), v.end(), 0);
+    const auto actual = cpputil::fmap(par, [](int x) { return x * 3; }, v);
+    const auto expect = cpputil::fmap([](int x) { return x * 3; }, v);
+    ASSERT_EQ(actual, expect);
+}
+
+TEST(Functional, filter_parallel) {
+    std::vector<int> v(10000);
+    std::iota(v.begin(), v.end(), 0);
+    const auto pred = [](int x) { return (x % 7 == 3); };
+    const auto actual = cpputil::filter(par, pred, v);
+    const auto expect = cpputil::filter(pred, v);
+    ASSERT_EQ(actual, expect);
+}
+
+TEST(Functional, filter_fmap_view) {
+    std::vector<int> v{1, 2, 3, 4, 5};
+    const auto pred = [](int x) { return (x > 3); };
+    const auto double_func = [](int x) { return x * 2; };
+    const auto actual = collect(fmap_view(double_func, filter_view(pred, v)));
+
+    const std::vector<int> expect{8, 10};
+    ASSERT_EQ(actual, expect);
+}
+
 TEST(Utilities, l2_norm_test) {
     const auto p1 = Data<>({0, {1, 1}});
     const auto p2 = Data<>({1, {5, 4}});
@@ -280,4 +307,820 @@ TEST(DataArray, load_csv) {
     ASSERT_EQ(dataset[dim], 14);
     ASSERT_EQ(dataset[dim + 1], 35);
     ASSERT_EQ(dataset[2 * dim - 1], 33);
-}
\ No newline at end of file
+}
+
+TEST(reduction, covariance) {
+    int n = 4, dim = 2;
+    auto db = DataArray(n, dim);
+    db.load(vector<float>{1, 1, 3, 1, 1, 3, 3, 3});
+
+    const auto mean = calc_mean(db);
+    ASSERT_EQ(mean[0], 2);
+    ASSERT_EQ(mean[1], 2);
+
+    const auto cov = calc_covariance(db, mean, 3);
+    ASSERT_EQ(cov, (vector<float>{1, 0, 0, 1}));
+}
+
+TEST(reduction, pca) {
+    int n = 200, dim = 3;
+    auto db = DataArray(n, dim);
+    for (int i = 0; i < n; ++i) {
+        const float t = i - n / 2, s = (i % 5) - 2;
+        db[i * dim] = t;
+        db[i * dim + 1] = t + 0.1 * s;
+        db[i * dim + 2] = 0.5 * s;
+    }
+
+    const auto pca = fit_pca(db, 1);
+    ASSERT_NEAR(abs(pca.components[0]), sqrt(0.5), 1e-3);
+    ASSERT_NEAR(abs(pca.components[1]), sqrt(0.5), 1e-3);
+
+    const auto reduced = pca.transform(db);
+    ASSERT_EQ(reduced.n, n);
+    ASSERT_EQ(reduced.dim, 1);
+    ASSERT_NEAR(abs(reduced[0]), 100 * sqrt(2), 1);
+}
+
+TEST(reduction, knn_scan_rerank) {
+    // 2 dimensional structure embedded in 16 dimensions with small noise
+    int n = 1000, n_queries = 10, dim = 16, k = 5;
+    auto db = DataArray(n, dim);
+    auto queries = DataArray(n_queries, dim);
+    mt19937 engine(1);
+    uniform_real_distribution<float> uniform;
+    normal_distribution<float> noise(0, 0.001);
+
+    vector<float> basis(2 * dim);
+    for (auto &e : basis) e = uniform(engine);
+    for (auto *array : {&db, &queries}) {
+        for (int i = 0; i < array->n; ++i) {
+            const float z0 = uniform(engine), z1 = uniform(engine);
+            for (int j = 0; j < dim; ++j) {
+                (*array)[i * dim + j] = z0 * basis[j] + z1 * basis[dim + j] + noise(engine);
+            }
+        }
+    }
+
+    const auto pca = fit_pca(db, 2);
+    const auto reduced_db = pca.transform(db);
+    const auto reduced_queries = pca.transform(queries);
+
+    auto gt = GroundTruth(n_queries, k);
+    for (int query_id = 0; query_id < n_queries; ++query_id) {
+        for (const auto &neighbor : knn_scan(k, queries.find(query_id), db)) {
+            gt.x[query_id].emplace_back(neighbor.id);
+        }
+    }
+
+    // only 2 * k of n rows reach the full dimensional rerank
+    const auto report = evaluate_search(k, n_queries, gt, [&](int query_id) {
+        return knn_scan_rerank(k, 2 * k, queries.find(query_id), db,
+                               reduced_queries.find(query_id), reduced_db);
+    });
+    ASSERT_GE(report.recall, 0.95);
+
+    const auto reports = benchmark_reduction(k, db, queries, gt, {2, 8}, {2 * k, 4 * k});
+    ASSERT_EQ(reports.size(), 4);
+    ASSERT_EQ(reports[1].out_dim, 2);
+    ASSERT_EQ(reports[1].n_candidates, 4 * k);
+    ASSERT_FLOAT_EQ(reports[0].report.recall, report.recall);
+    for (int i = 0; i < reports.size(); i += 2) {
+        // the rerank only sees more candidates
+        ASSERT_GE(reports[i + 1].report.recall, reports[i].report.recall);
+    }
+    for (const auto &r : reports) ASSERT_GT(r.speedup, 0);
+}
+
+TEST(reorder, hilbert_index) {
+    ASSERT_EQ(hilbert_index(2, 0, 0), 0);
+    ASSERT_EQ(hilbert_index(2, 0, 1), 1);
+    ASSERT_EQ(hilbert_index(2, 1, 1), 2);
+    ASSERT_EQ(hilbert_index(2, 1, 0), 3);
+    ASSERT_EQ(hilbert_index(4, 3, 0), 15);
+}
+
+TEST(reorder, graph_order) {
+    vector<Neighbors> graph(5);
+    graph[0] = {{0, 3}};
+    graph[3] = {{0, 1}, {0, 0}};
+    graph[1] = {{0, 3}};
+
+    const auto order = graph_order(graph);
+    ASSERT_EQ(order, (vector<int>{0, 3, 1, 2, 4}));
+
+    const auto reordered = reorder(graph, order);
+    ASSERT_EQ(reordered[0][0].id, 1);
+    ASSERT_EQ(reordered[1][0].id, 2);
+}
+
+TEST(reorder, cluster_order) {
+    int n = 6, dim = 2;
+    auto db = DataArray(n, dim);
+    db.load(vector<float>{0, 0, 10, 10, 0, 1, 10, 11, 1, 0, 11, 10});
+
+    const auto order = cluster_order(db, 2);
+    const auto reordered = reorder(db, order);
+    for (int new_id = 0; new_id < n; ++new_id) {
+        ASSERT_EQ(*reordered.find(new_id), *db.find(order[new_id]));
+    }
+
+    // rows of the same cluster are contiguous
+    const auto first = *reordered.find(0);
+    for (int new_id = 0; new_id < n; ++new_id) {
+        const bool same = (*reordered.find(new_id) < 5) == (first < 5);
+        ASSERT_EQ(same, new_id < 3);
+    }
+
+    auto hilbert = hilbert_order(db);
+    sort(hilbert.begin(), hilbert.end());
+    ASSERT_EQ(hilbert, (vector<int>{0, 1, 2, 3, 4, 5}));
+
+    auto queries = DataArray(1, dim);
+    queries.load(vector<float>{9, 9});
+    auto res = knn_scan(1, queries.find(0), reordered);
+    restore_ids(res, order);
+    ASSERT_EQ(res[0].id, 1);
+}
+
+TEST(sharding, merge_neighbors) {
+    vector<Neighbors> lists{{{1, 10}, {4, 11}},
+                            {{2, 20}, {3, 21}, {5, 22}},
+                            {{0.5, 30}, {9, -1}}};
+    const auto res = merge_neighbors(lists, 4);
+    ASSERT_EQ(res.size(), 4);
+    ASSERT_EQ(res[0].id, 30);
+    ASSERT_EQ(res[1].id, 10);
+    ASSERT_EQ(res[2].id, 20);
+    ASSERT_EQ(res[3].id, 21);
+}
+
+TEST(sharding, search) {
+    int n = 100, dim = 4, k = 5;
+    auto db = DataArray(n, dim);
+    auto queries = DataArray(3, dim);
+    mt19937 engine(0);
+    uniform_real_distribution<float> uniform;
+    for (auto &e : db.x) e = uniform(engine);
+    for (auto &e : queries.x) e = uniform(engine);
+
+    const string base_path = "/tmp/cpputil_sharding_test.fvecs";
+    db.save_fvecs(base_path);
+
+    ShardedSearch sharded(base_path, n, dim, 3);
+    ASSERT_EQ(sharded.offsets, (vector<int>{0, 33, 66, 100}));
+
+    const auto results = sharded.search(k, queries);
+    for (int i = 0; i < queries.n; ++i) {
+        const auto expect = knn_scan(k, queries.find(i), db);
+        ASSERT_EQ(results[i].size(), k);
+        for (int j = 0; j < k; ++j) ASSERT_EQ(results[i][j].id, expect[j].id);
+    }
+
+    // threads are reused across batches
+    ASSERT_GE(count_cpus(), 1);
+    BatchThreads threads(2);
+    for (int round = 0; round < 3; ++round) {
+        const auto batch = knn_scan_batch(k, queries, db, threads);
+        for (int i = 0; i < queries.n; ++i) ASSERT_EQ(batch[i][0].id, results[i][0].id);
+    }
+}
+
+TEST(sharding, failed_start) {
+    int n = 10, dim = 4;
+    auto db = DataArray(n, dim);
+    const string base_path = "/tmp/cpputil_sharding_fail.fvecs";
+    db.save_fvecs(base_path);
+
+    // socket paths longer than sun_path make every worker fail
+    const string work_dir = "/tmp/" + string(100, 'x');
+    mkdir(work_dir.c_str(), 0755);
+
+    const auto start = get_now();
+    ASSERT_THROW(ShardedSearch(base_path, n, dim, 2, work_dir), runtime_error);
+    ASSERT_LT(get_duration(start, get_now()), 10000000);
+
+    const auto prefix = work_dir + "/cpputil_shard_" + to_string(getpid());
+    ASSERT_FALSE(ifstream(prefix + ".0.fvecs"));
+    ASSERT_FALSE(ifstream(prefix + ".1.fvecs"));
+    ASSERT_EQ(waitpid(-1, nullptr, WNOHANG), -1);
+
+    // more rows than the file holds
+    try {
+        ShardedSearch(base_path, 2 * n, dim, 2, work_dir);
+        FAIL();
+    } catch (const runtime_error &e) {
+        ASSERT_EQ(string(e.what()), "rows out of range: " + base_path);
+    }
+    ASSERT_FALSE(ifstream(prefix + ".0.fvecs"));
+    rmdir(work_dir.c_str());
+}
+
+TEST(scratch, visited_set) {
+    VisitedSet visited;
+    visited.reset(4);
+    ASSERT_TRUE(visited.insert(2));
+    ASSERT_FALSE(visited.insert(2));
+    ASSERT_TRUE(visited.contains(2));
+
+    visited.reset(4);
+    ASSERT_FALSE(visited.contains(2));
+}
+
+TEST(scratch, knn_scan_reuse_result) {
+    int n = 5, dim = 2;
+    auto db = DataArray(n, dim);
+    db.load(vector<float>{0, 0, 1, 1, 2, 2, 3, 3, 1, 1});
+
+    auto queries = DataArray(2, dim);
+    queries.load(vector<float>{0, 0, 3, 3});
+
+    Neighbors result;
+    result.reserve(3);
+    const auto data = result.data();
+
+    knn_scan(3, queries.find(0), db, result);
+    ASSERT_EQ(result.size(), 3);
+    ASSERT_EQ(result[0].id, 0);
+    // duplicated distances are kept
+    ASSERT_EQ(result[1].dist, result[2].dist);
+
+    knn_scan(2, queries.find(1), db, result);
+    ASSERT_EQ(result.size(), 2);
+    ASSERT_EQ(result[0].id, 3);
+    ASSERT_EQ(result[1].id, 2);
+    ASSERT_EQ(result.data(), data);
+}
+
+TEST(binary, hamming_dist) {
+    const int n_words = 13;
+    mt19937_64 engine(0);
+    vector<uint64_t> a(n_words), b(n_words);
+    for (auto &e : a) e = engine();
+    for (auto &e : b) e = engine();
+
+    int expect = 0;
+    for (int i = 0; i < n_words; ++i) {
+        for (int bit = 0; bit < 64; ++bit) expect += ((a[i] ^ b[i]) >> bit) & 1;
+    }
+
+    for (int len = 1; len <= n_words; ++len) {
+        ASSERT_EQ(hamming_dist(a.data(), b.data(), len),
+                  hamming_dist_scalar(a.data(), b.data(), len));
+    }
+    ASSERT_EQ(hamming_dist(a.data(), b.data(), n_words), expect);
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+    for (int len = 1; len <= n_words; ++len) {
+        ASSERT_EQ(hamming_dist_avx512(a.data(), b.data(), len),
+                  hamming_dist_scalar(a.data(), b.data(), len));
+    }
+#endif
+}
+
+TEST(binary, hamming_knn_scan) {
+    // single-word, gathered and per-code paths
+    for (const int dim : {64, 130, 600}) {
+        int n = 61, k = 7;
+        auto codes = BinaryCodes(n, dim);
+        mt19937_64 engine(0);
+        for (auto &e : codes.x) e = engine();
+
+        vector<uint64_t> query(codes.n_words);
+        for (auto &e : query) e = engine();
+
+        Neighbors expect;
+        for (int i = 0; i < n; ++i) {
+            expect.emplace_back(hamming_dist_scalar(query.data(), codes.find(i),
+                                                    codes.n_words), i);
+        }
+        stable_sort(expect.begin(), expect.end(), CompLess());
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+        int dists[8];
+        hamming_dist_block8_avx512(query.data(), codes, 8, dists);
+        for (int j = 0; j < 8; ++j) {
+            ASSERT_EQ(dists[j], hamming_dist_scalar(query.data(), codes.find(8 + j),
+                                                    codes.n_words));
+        }
+#endif
+
+        const auto result = hamming_knn_scan(k, query.data(), codes);
+        ASSERT_EQ(result.size(), k);
+        for (int i = 0; i < k; ++i) ASSERT_EQ(result[i].dist, expect[i].dist);
+
+        auto queries = BinaryCodes(4, dim);
+        ASSERT_GT(benchmark_hamming_scan(k, queries, codes), 0);
+    }
+}
+
+TEST(binary, search) {
+    int n = 4, dim = 2;
+    auto db = DataArray(n, dim);
+    db.load(vector<float>{1, 1, -1, 1, -1, -1, 2, 3});
+
+    const auto codes = encode_binary(db);
+    ASSERT_EQ(codes.n_words, 1);
+    ASSERT_EQ(codes.x, (vector<uint64_t>{3, 2, 0, 3}));
+
+    auto queries = DataArray(1, dim);
+    queries.load(vector<float>{1.5, 2});
+    const auto query_codes = encode_binary(queries);
+
+    const auto knn = hamming_knn_scan(2, query_codes.find(0), codes);
+    ASSERT_EQ(knn[0].dist, 0);
+    ASSERT_EQ(knn[1].dist, 0);
+
+    const auto range = hamming_range_search(query_codes.find(0), codes, 1);
+    ASSERT_EQ(range.size(), 3);
+    ASSERT_EQ(range[2].id, 1);
+
+    const auto reranked = hamming_knn_rerank(1, 2, query_codes.find(0), codes,
+                                             queries.find(0), db);
+    ASSERT_EQ(reranked[0].id, 3);
+}
+
+// version 1.0 npy file of n x dim values converted to T
+template<typename T>
+void write_npy(const string &path, const string &descr, int n, int dim,
+               const vector<float> &values) {
+    ofstream npy(path, ios::binary);
+    string header_str = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (" +
+                        to_string(n) + ", " + to_string(dim) + "), }";
+    header_str.resize(128 - 10 - 1, ' ');
+    header_str += '\n';
+    const uint16_t header_len = header_str.size();
+    npy.write("\x93NUMPY\x01\x00", 8);
+    npy.write((const char *) &header_len, 2);
+    npy << header_str;
+
+    const vector<T> converted(values.begin(), values.end());
+    npy.write((const char *) converted.data(), converted.size() * sizeof(T));
+}
+
+TEST(DataArray, load_formats) {
+    const int n = 5, dim = 3;
+    vector<float> values(n * dim);
+    iota(values.begin(), values.end(), 0);
+
+    {
+        ofstream bvecs("/tmp/cpputil_test.bvecs", ios::binary);
+        ofstream u8bin("/tmp/cpputil_test.u8bin", ios::binary);
+        ofstream fbin("/tmp/cpputil_test.fbin", ios::binary);
+        const int header[2] = {n, dim};
+        u8bin.write((const char *) header, sizeof(header));
+        fbin.write((const char *) header, sizeof(header));
+        fbin.write((const char *) values.data(), values.size() * sizeof(float));
+        for (int i = 0; i < n; ++i) {
+            bvecs.write((const char *) &dim, 4);
+            for (int j = 0; j < dim; ++j) {
+                const auto val = static_cast<uint8_t>(values[i * dim + j]);
+                bvecs.write((const char *) &val, 1);
+                u8bin.write((const char *) &val, 1);
+            }
+        }
+
+    }
+    write_npy<float>("/tmp/cpputil_test.npy", "<f4", n, dim, values);
+
+    DataArray(n, dim).save_fvecs("/tmp/cpputil_test.fvecs");
+    for (const string ext : {"bvecs", "u8bin", "fbin", "npy"}) {
+        // rows [1, 4)
+        auto dataset = DataArray(3, dim);
+        dataset.load("/tmp/cpputil_test." + ext, 1);
+        ASSERT_EQ(dataset.x, vector<float>(values.begin() + dim, values.begin() + 4 * dim)) << ext;
+
+        auto out_of_range = DataArray(3, dim);
+        ASSERT_THROW(out_of_range.load("/tmp/cpputil_test." + ext, 3), runtime_error) << ext;
+    }
+
+    auto wrong_dim = DataArray(1, dim + 1);
+    ASSERT_THROW(wrong_dim.load("/tmp/cpputil_test.fvecs"), runtime_error);
+}
+
+TEST(DataArray, load_npy_dtypes) {
+    const int n = 4, dim = 3;
+    vector<float> values(n * dim);
+    iota(values.begin(), values.end(), -5);
+    const string path = "/tmp/cpputil_test_dtype.npy";
+
+    const auto check = [&](const vector<float> &expect) {
+        auto dataset = DataArray(n, dim);
+        dataset.load(path);
+        ASSERT_EQ(dataset.x, expect);
+    };
+    write_npy<double>(path, "<f8", n, dim, values);
+    check(values);
+    write_npy<int8_t>(path, "|i1", n, dim, values);
+    check(values);
+    write_npy<int32_t>(path, "<i4", n, dim, values);
+    check(values);
+
+    vector<float> unsigned_values(values.size());
+    iota(unsigned_values.begin(), unsigned_values.end(), 200);
+    write_npy<uint8_t>(path, "|u1", n, dim, unsigned_values);
+    check(unsigned_values);
+
+    write_npy<int16_t>(path, "<i2", n, dim, values);
+    ASSERT_THROW(check(values), runtime_error);
+}
+
+TEST(GroundTruth, load_ibin) {
+    const int n = 3, k = 4;
+    const string path = "/tmp/cpputil_test.ibin";
+    vector<int> ids(n * k);
+    iota(ids.begin(), ids.end(), 0);
+    {
+        ofstream ofs(path, ios::binary);
+        const int header[2] = {n, k};
+        ofs.write((const char *) header, sizeof(header));
+        ofs.write((const char *) ids.data(), ids.size() * sizeof(int));
+    }
+
+    // the first 2 of each row
+    auto gt = GroundTruth(n, 2);
+    gt.load(path);
+    ASSERT_EQ(gt.x[2], (vector<int>{8, 9}));
+
+    auto too_many_rows = GroundTruth(n + 1, k);
+    try {
+        too_many_rows.load(path);
+        FAIL();
+    } catch (const runtime_error &e) {
+        ASSERT_EQ(string(e.what()), "rows out of range: " + path);
+    }
+    auto too_large_k = GroundTruth(n, k + 1);
+    ASSERT_THROW(too_large_k.load(path), runtime_error);
+
+    // header claims more rows than the file holds
+    {
+        ofstream ofs(path, ios::binary);
+        const int header[2] = {n + 1, k};
+        ofs.write((const char *) header, sizeof(header));
+        ofs.write((const char *) ids.data(), ids.size() * sizeof(int));
+    }
+    auto truncated = GroundTruth(n + 1, k);
+    try {
+        truncated.load(path);
+        FAIL();
+    } catch (const runtime_error &e) {
+        ASSERT_EQ(string(e.what()), "truncated file: " + path);
+    }
+}
+
+TEST(knn_scan, cosine) {
+    int n = 4, dim = 2;
+    auto db = DataArray(n, dim);
+    db.load(vector<float>{2, 0, 0, 3, 1, 1, -1, 0});
+
+    auto queries = DataArray(1, dim);
+    queries.load(vector<float>{2, 2 * static_cast<float>(sqrt(3))});
+    auto query = queries.find(0);
+
+    const auto expect = knn_scan(2, query, db, "cosine");
+    ASSERT_EQ(expect[0].id, 2);
+    ASSERT_EQ(expect[1].id, 1);
+
+    normalize(db);
+    ASSERT_TRUE(db.normalized);
+    ASSERT_FLOAT_EQ(l2_norm(Data<>(vector<float>(db.find(1), db.find(2)))), 1);
+
+    const auto res = knn_scan(2, query, db, "cosine");
+    ASSERT_EQ(res[0].id, 2);
+    ASSERT_FLOAT_EQ(res[0].dist, expect[0].dist);
+    ASSERT_FLOAT_EQ(res[1].dist, 0.5 * sqrt(3));
+
+    const auto angular = knn_scan(4, query, db, "angular");
+    ASSERT_EQ(angular[3].id, 3);
+    ASSERT_NEAR(angular[1].dist, 1.0 / 6, 1e-6);
+    ASSERT_NEAR(angular[3].dist, 2.0 / 3, 1e-6);
+
+    ASSERT_THROW(knn_scan(1, query, db, "l1"), runtime_error);
+}
+
+#ifdef __AVX__
+TEST(dist, ip_avx) {
+    const float a[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+    const float b[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2};
+    ASSERT_EQ(ip_avx(a, b, 11), 77);
+    ASSERT_EQ(ip_avx(a, b, 3), 6);
+}
+#endif
+
+TEST(multi_vector, maxsim_search) {
+    int dim = 9;
+    mt19937 engine(0);
+    uniform_real_distribution<float> uniform(-1, 1);
+
+    const vector<int> lengths{6, 0, 2, 5};
+    auto vectors = DataArray(13, dim);
+    for (auto &e : vectors.x) e = uniform(engine);
+    const auto docs = MultiVectorArray::from_lengths(vectors, lengths);
+    ASSERT_EQ(docs.n_docs(), 4);
+    ASSERT_EQ(docs.offsets, (vector<int>{0, 6, 6, 8, 13}));
+
+    auto query_tokens = DataArray(3, dim);
+    for (auto &e : query_tokens.x) e = uniform(engine);
+
+    vector<float> expect(docs.n_docs(), 0);
+    for (int doc_id = 0; doc_id < docs.n_docs(); ++doc_id) {
+        if (docs.n_tokens(doc_id) == 0) {
+            expect[doc_id] = -float_max;
+            ASSERT_EQ(max_sim(query_tokens, docs, doc_id), -float_max);
+            continue;
+        }
+        for (int q = 0; q < query_tokens.n; ++q) {
+            float max_ip = -float_max;
+            for (int t = docs.offsets[doc_id]; t < docs.offsets[doc_id + 1]; ++t) {
+                float ip = 0;
+                for (int j = 0; j < dim; ++j) ip += query_tokens[q * dim + j] * vectors[t * dim + j];
+                max_ip = max(max_ip, ip);
+            }
+            expect[doc_id] += max_ip;
+        }
+        ASSERT_NEAR(max_sim(query_tokens, docs, doc_id), expect[doc_id], 1e-5);
+    }
+
+    const auto res = maxsim_search(4, query_tokens, docs);
+    ASSERT_EQ(res.size(), 4);
+    for (int i = 0; i + 1 < res.size(); ++i) ASSERT_GE(res[i].dist, res[i + 1].dist);
+    ASSERT_NEAR(res[0].dist, *max_element(expect.begin(), expect.end()), 1e-5);
+    ASSERT_EQ(res[3].id, 1);
+
+    Neighbors reused;
+    maxsim_search(4, query_tokens, docs, reused);
+    ASSERT_EQ(reused.size(), res.size());
+    for (int i = 0; i < res.size(); ++i) ASSERT_EQ(reused[i].id, res[i].id);
+
+    const auto batch = maxsim_search_batch(2, {query_tokens, query_tokens}, docs);
+    ASSERT_EQ(batch[1][0].id, res[0].id);
+    ASSERT_EQ(batch[1][1].id, res[1].id);
+
+    BatchThreads threads(2);
+    const auto pooled = maxsim_search_batch(4, {query_tokens, query_tokens, query_tokens},
+                                            docs, threads);
+    ASSERT_EQ(pooled[2].size(), res.size());
+    for (int i = 0; i < res.size(); ++i) ASSERT_EQ(pooled[2][i].id, res[i].id);
+
+    ASSERT_THROW(MultiVectorArray(vectors, {0, 5}), runtime_error);
+}
+
+TEST(DataArray, huge_pages) {
+    const int n = 10000, dim = 128;
+    auto dataset = DataArray(n, dim, true);
+    ASSERT_EQ(dataset.x.size(), n * dim);
+    ASSERT_EQ(dataset.x[n * dim - 1], 0);
+
+    dataset[dim] = 1;
+    auto queries = DataArray(1, dim);
+    queries[0] = 1;
+    ASSERT_EQ(knn_scan(1, queries.find(0), dataset)[0].id, 1);
+}
+
+TEST(knn_scan, pipelined) {
+    int n = 103, dim = 13, k = 10;
+    auto db = DataArray(n, dim);
+    auto queries = DataArray(1, dim);
+    mt19937 engine(0);
+    uniform_real_distribution<float> uniform;
+    for (auto &e : db.x) e = uniform(engine);
+    for (auto &e : queries.x) e = uniform(engine);
+    const auto query = queries.find(0);
+
+    Neighbors expect;
+    for (int i = 0; i < n; ++i) {
+        float dist = 0;
+        for (int j = 0; j < dim; ++j) dist += pow(db[i * dim + j] - query[j], 2);
+        expect.emplace_back(sqrt(dist), i);
+    }
+    sort_neighbors(expect);
+
+    for (const int distance : {0, 3, 200}) {
+        SearchBuffer buffer;
+        buffer.prefetch_distance = distance;
+        Neighbors res;
+        knn_scan(k, query, db, res, "l2", buffer);
+        for (int i = 0; i < k; ++i) {
+            ASSERT_EQ(res[i].id, expect[i].id);
+            ASSERT_FLOAT_EQ(res[i].dist, expect[i].dist);
+        }
+    }
+}
+
+// uniform random rows and queries, the brute-force kNN graph of the rows
+// and the exact top-k of each query
+struct GraphFixture {
+    DataArray db, queries;
+    vector<Neighbors> graph;
+    GroundTruth gt;
+
+    GraphFixture(int n, int dim, int n_queries, int k, int degree) :
+            db(n, dim), queries(n_queries, dim), graph(n), gt(n_queries, k) {
+        mt19937 engine(0);
+        uniform_real_distribution<float> uniform;
+        for (auto &e : db.x) e = uniform(engine);
+        for (auto &e : queries.x) e = uniform(engine);
+
+        for (int i = 0; i < n; ++i) {
+            graph[i] = knn_scan(degree + 1, db.find(i), db);
+            graph[i].erase(graph[i].begin());
+        }
+        for (int q = 0; q < n_queries; ++q) {
+            for (const auto &neighbor : knn_scan(k, queries.find(q), db)) {
+                gt.x[q].emplace_back(neighbor.id);
+            }
+        }
+    }
+};
+
+TEST(graph_search, knn_graph) {
+    int dim = 4, k = 5;
+    const GraphFixture fixture(300, dim, 10, k, 10);
+    const auto &db = fixture.db;
+    const auto &queries = fixture.queries;
+    const auto &graph = fixture.graph;
+
+    float recall = 0;
+    for (int q = 0; q < queries.n; ++q) {
+        const auto res = graph_search(k, 50, queries.find(q), db, graph);
+        const auto expect = knn_scan(k, queries.find(q), db);
+        ASSERT_EQ(res.size(), k);
+        ASSERT_FLOAT_EQ(res[0].dist, l2_dist(queries.find(q), db.find(res[0].id), dim));
+        recall += calc_recall(res, expect, k);
+    }
+    ASSERT_GE(recall / queries.n, 0.9);
+}
+
+TEST(index, crc32c) {
+    const string data = "123456789";
+    ASSERT_EQ(crc32c(data.data(), data.size()), 0xE3069283);
+}
+
+TEST(index, save_load) {
+    const string path = "/tmp/cpputil_test.index";
+    int n = 5, dim = 3;
+    auto db = DataArray(n, dim);
+    iota(db.x.begin(), db.x.end(), 0);
+    db.normalized = true;
+
+    auto gt = GroundTruth(2, 3);
+    gt.x[0] = {4, 2, 0};
+    gt.x[1] = {1, 3};
+
+    vector<Neighbors> graph(3);
+    graph[0] = {{0.5, 1}, {1.5, 2}};
+    graph[2] = {{2.5, 0}};
+
+    {
+        IndexWriter writer(path);
+        writer.add("base", db);
+        writer.add("gt", gt);
+        writer.add("graph", graph);
+        writer.add("codes", encode_binary(db));
+        writer.add("meta", json{{"medoid", 2}, {"metric", "l2"}});
+    }
+
+    {
+        IndexReader reader(path);
+        for (const auto &section : reader.sections) {
+            ASSERT_EQ(section.offset % index_page_size, 0);
+        }
+
+        const auto loaded = reader.load_data_array("base");
+        ASSERT_EQ(loaded.n, n);
+        ASSERT_EQ(loaded.dim, dim);
+        ASSERT_EQ(loaded.x, db.x);
+        ASSERT_TRUE(loaded.normalized);
+        ASSERT_EQ(reader.data<float>("base", SectionType::float32)[4], 4);
+
+        ASSERT_EQ(reader.load_ground_truth("gt").x, gt.x);
+
+        const auto loaded_graph = reader.load_graph("graph");
+        ASSERT_EQ(loaded_graph.size(), 3);
+        ASSERT_EQ(loaded_graph[0][1].id, 2);
+        ASSERT_TRUE(loaded_graph[1].empty());
+        ASSERT_EQ(loaded_graph[2][0].dist, 2.5);
+
+        ASSERT_EQ(reader.load_binary_codes("codes").x, encode_binary(db).x);
+        ASSERT_EQ(reader.load_json("meta")["medoid"], 2);
+
+        ASSERT_FALSE(reader.contains("centroids"));
+        ASSERT_THROW(reader.load_data_array("gt"), runtime_error);
+    }
+
+    // corrupt one byte of the base section
+    {
+        fstream fs(path, ios::binary | ios::in | ios::out);
+        fs.seekp(index_page_size + 5);
+        fs.put(0x7f);
+    }
+    ASSERT_THROW(IndexReader reader(path), runtime_error);
+    IndexReader unverified(path, false);
+    ASSERT_EQ(unverified.load_ground_truth("gt").x, gt.x);
+}
+
+TEST(index, invalid_sections) {
+    const string path = "/tmp/cpputil_test_invalid.index";
+    const vector<float> values(6, 1);
+    {
+        IndexWriter writer(path);
+        writer.add("base", SectionType::float32, values.data(),
+                   values.size() * sizeof(float), 2, 4);
+    }
+    ASSERT_THROW(IndexReader reader(path), runtime_error);
+
+    // offsets of a 2-node graph with 1 edge, not monotonic
+    const vector<int64_t> offsets{0, 2, 1, 0};
+    {
+        IndexWriter writer(path);
+        writer.add("graph", SectionType::neighbors, offsets.data(),
+                   offsets.size() * sizeof(int64_t), 2, 1);
+        writer.close();
+    }
+    IndexReader reader(path);
+    ASSERT_THROW(reader.load_graph("graph"), runtime_error);
+
+    // edit the first table entry and recompute the table checksum
+    const auto rewrite_entry = [&](const function<void(SectionEntry &)> &edit) {
+        {
+            IndexWriter writer(path);
+            writer.add("base", SectionType::float32, values.data(),
+                       values.size() * sizeof(float), 2, 3);
+        }
+        fstream fs(path, ios::binary | ios::in | ios::out);
+        IndexHeader header{};
+        fs.read((char *) &header, sizeof(header));
+        SectionEntry entry{};
+        fs.seekg(header.table_offset);
+        fs.read((char *) &entry, sizeof(entry));
+
+        edit(entry);
+        header.table_checksum = calc_checksum(&entry, sizeof(entry));
+        fs.seekp(header.table_offset);
+        fs.write((const char *) &entry, sizeof(entry));
+        fs.seekp(0);
+        fs.write((const char *) &header, sizeof(header));
+    };
+
+    rewrite_entry([](SectionEntry &entry) {});
+    ASSERT_NO_THROW(IndexReader valid(path));
+    rewrite_entry([](SectionEntry &entry) { fill(begin(entry.name), end(entry.name), 'x'); });
+    ASSERT_THROW(IndexReader unterminated(path, false), runtime_error);
+    rewrite_entry([](SectionEntry &entry) { entry.offset += 4; });
+    ASSERT_THROW(IndexReader unaligned(path, false), runtime_error);
+}
+
+TEST(perf, count_event) {
+    ASSERT_EQ(perf_cache_config(PERF_COUNT_HW_CACHE_DTLB), 0x10003);
+
+    long long count;
+    try {
+        vector<float> v(1 << 20, 1);
+        count = count_event([&]() {
+            volatile float sum = std::accumulate(v.begin(), v.end(), 0.0f);
+            (void) sum;
+        });
+    } catch (const runtime_error &) {
+        GTEST_SKIP() << "perf_event_open is not available";
+    }
+    ASSERT_GE(count, 0);
+}
+
+TEST(perf, benchmark_prefetch) {
+    int k = 5;
+    const GraphFixture fixture(300, 4, 10, k, 10);
+    const auto reports = benchmark_prefetch(k, 50, fixture.db, fixture.graph,
+                                            fixture.queries, fixture.gt);
+    ASSERT_EQ(reports.size(), 8);
+    ASSERT_EQ(get_search_buffer().prefetch_distance, SearchBuffer().prefetch_distance);
+
+    for (const auto &report : reports) {
+        // prefetching and huge pages must not change the results
+        const auto &baseline = (report.search == "knn_scan") ? reports[0] : reports[1];
+        ASSERT_EQ(report.search, baseline.search);
+        ASSERT_FLOAT_EQ(report.report.recall, baseline.report.recall);
+        if (report.search == "knn_scan") {
+            ASSERT_FLOAT_EQ(report.report.recall, 1);
+        }
+        ASSERT_EQ(report.cache_misses == -1, baseline.cache_misses == -1);
+    }
+    ASSERT_EQ(reports[0].prefetch_distance, 0);
+    ASSERT_TRUE(reports[7].huge_pages);
+}
+
+TEST(reorder, benchmark_reorder) {
+    int k = 5;
+    const GraphFixture fixture(300, 4, 10, k, 10);
+    const auto &db = fixture.db;
+    const auto &queries = fixture.queries;
+    const auto &graph = fixture.graph;
+
+    const auto &gt = fixture.gt;
+
+    for (const auto &order : {cluster_order(db, 8), hilbert_order(db), graph_order(graph)}) {
+        const auto report = benchmark_reorder(k, 50, db, graph, queries, gt, order);
+        // same graph, only renumbered
+        ASSERT_FLOAT_EQ(report.after.recall, report.before.recall);
+        ASSERT_GE(report.after.recall, 0.9);
+        ASSERT_EQ(report.cache_misses_before == -1, report.cache_misses_after == -1);
+    }
+}